@@ -23,15 +23,63 @@
 
 #include <iostream>
 #include <mkl.h>
+#include <cstdlib>
+#include <atomic>
+#include <new>
+
+// Align the heap storage of all matrices for full width vector loads.
+#define EIGEN_MAX_ALIGN_BYTES 64
+
+// Let Eigen check in the allocation check that the time step does not
+// allocate.
+#ifdef CHECK_ALLOCATIONS
+#define EIGEN_RUNTIME_NO_MALLOC
+#endif
+
 #include <eigen3/Eigen/Dense>
 #include <cmath>
 #include <random>
 #include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <ctime>
 #include <fstream>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sstream>
+#include <cstdio>
+#include <climits>
+#include <chrono>
+#include <iomanip>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 
 #define EIGEN_USE_MKL_ALL
 
+// Defaults of the parameters of the simulation. All of them can be changed
+// at runtime by a configuration file or the command line, see params_set().
+
 // Cofficients for the Lennard-Jones potential.
 #define SIGMA 1.0
 #define EPSILON 1.0
@@ -48,6 +96,98 @@
 // Single timestep for integration /s.
 #define TIMESTEP 1e-4
 
+// Cutoff radius of the Lennard-Jones interaction in units of SIGMA. Pairs
+// further apart are not evaluated.
+#define RCUT 2.5
+
+// Ways of shifting the truncated Lennard-Jones potential: Not at all, by the
+// energy at the cutoff radius so the potential is continuous, or additionally
+// by the force at the cutoff radius so the force is continuous too.
+#define SHIFT_NONE 0
+#define SHIFT_ENERGY 1
+#define SHIFT_FORCE 2
+
+// Shifting of the truncated Lennard-Jones potential.
+#define SHIFT SHIFT_ENERGY
+
+// Skin distance of the neighbour list in units of SIGMA. The list holds all
+// pairs closer than RCUT + SKIN and stays valid until a particle moved more
+// than half of the skin.
+#define SKIN 0.3
+
+// Inner steps per time step of the multiple time step (r-RESPA) integrator;
+// 1 integrates all forces with the same time step. The forces of the pairs
+// closer than RINNER, in units of SIGMA, are integrated with the inner
+// steps, the remaining ones with the whole time step. The split is smoothed
+// over a shell of RESPA_SWITCH inside RINNER.
+#define RESPA 1
+#define RINNER 2.0
+#define RESPA_SWITCH 0.5
+
+// 1 lets the vector force kernels calculate the pairs in single precision,
+// while the accelerations are summed up and integrated in double precision.
+// 0 calculates everything in double precision.
+#define MIXED 0
+
+// True if a limited and closed box should be simulated, else the box is
+// periodic in all dimensions.
+#define CLOSED true
+
+// Bytes per value in the trajectory file: 4 for float, 8 for double.
+#define TRAJECTORY_PRECISION 4
+
+// Time steps between two frames of the positions, velocities and forces.
+// Every field goes into its own trajectory file; 0 writes no file at all.
+#define POSITION_STRIDE 1
+#define VELOCITY_STRIDE 0
+#define FORCE_STRIDE 0
+
+// First particle and number of particles written to the trajectory files. A
+// negative number writes all particles from the first one on.
+#define OUTPUT_FIRST 0
+#define OUTPUT_COUNT -1
+
+// Number of snapshots the simulation can hand over to the writer thread
+// before it has to wait for the disk.
+#define WRITER_BUFFERS 3
+
+// Time steps between two checkpoints of the whole simulation state.
+#define CHECKPOINT_STRIDE 100
+
+// Minimal number of time steps between two sortings of the particles along
+// a Morton curve. The particles are only sorted when the neighbour list is
+// rebuilt anyway.
+#define SORT_STRIDE 100
+
+// Time steps between two entries of the energies, the temperature and the
+// pressure in the observables file.
+#define OBSERVE_STRIDE 10
+
+// Time steps between two balancings of the sub-boxes of the MPI ranks by
+// their measured force time; 0 keeps the sub-boxes equal.
+#define BALANCE_STRIDE 0
+
+// Part of the way to the evenly loaded borders that the borders of the
+// sub-boxes move at one balancing. Less than one damps the noise of the
+// measured times.
+#define BALANCE_DAMPING 0.5
+
+// Minimal run time of every case of the benchmark /s.
+#define BENCHMARK_TIME 0.2
+
+// Time step of the energy drift check in units of sigma * sqrt(mass /
+// epsilon), the number of time steps and the time steps between two samples
+// of the energy.
+#define DRIFT_TIMESTEP 0.005
+#define DRIFT_STEPS 1000
+#define DRIFT_SAMPLE 10
+
+// Largest drift of a mixed precision kernel as multiple of the drift of its
+// double precision one, plus a floor for a double precision drift close to
+// zero, relative to the energy per unit of time.
+#define DRIFT_FACTOR 2
+#define DRIFT_FLOOR 1e-6
+
 // Starting temperature of the system /K.
 #define TEMP 200
 
@@ -59,52 +199,665 @@
 
 using namespace Eigen;
 
-// Typedefs for special Matrix constructions.
-typedef Matrix<double, 3, TOTAL_PARTICLE> Matrix3Td;
+// Number of doubles every component stream of the particles is padded to.
+// Eight doubles fill 64 bytes, the width of an AVX-512 register.
+#define SIMD_WIDTH 8
+
+// Ranges of the force: all pairs, the inner pairs integrated with the inner
+// steps of a multiple time step run and the outer ones integrated with the
+// whole time step.
+#define RANGE_ALL 0
+#define RANGE_INNER 1
+#define RANGE_OUTER 2
+#define RANGES 3
+
+// Fields of the particles that can be written to trajectory files.
+#define FIELD_POSITIONS 0
+#define FIELD_VELOCITIES 1
+#define FIELD_FORCES 2
+#define FIELDS 3
+
+/**
+ * \brief Parameters of a simulation, set at runtime.
+ *
+ * Every parameter starts with the default given by the defines above and can
+ * be changed by a configuration file and the command line. */
+struct Parameters {
+  // Cofficients for the Lennard-Jones potential and mass of an atom.
+  double sigma, epsilon, mass;
+
+  // Number of particles and of time steps.
+  long particles, timesteps;
+
+  // Single timestep for integration /s and starting temperature /K.
+  double timestep, temp;
+
+  // Cutoff radius and skin of the neighbour list in units of sigma.
+  double rcut, skin;
+
+  // Inner steps per time step of the multiple time step integrator and
+  // radius of the inner forces in units of sigma.
+  int respa;
+  double rinner;
+
+  // Shifting of the truncated potential, one of the SHIFT_ values.
+  int shift;
+
+  // True if the box is closed, else it is periodic.
+  bool closed;
+
+  // Number of threads; 0 lets OpenMP decide.
+  int threads;
+
+  // Bytes per value in the trajectory files.
+  int precision;
+
+  // Time steps between two frames of every field; 0 writes no file.
+  int strides[FIELDS];
+
+  // First particle and number of particles written to the trajectory files.
+  long output_first, output_count;
+
+  // Time steps between two checkpoints; 0 writes none.
+  long checkpoint_stride;
+
+  // Minimal time steps between two sortings of the particles; 0 keeps their
+  // order.
+  long sort_stride;
+
+  // Time steps between two entries of the observables file; 0 writes none.
+  long observe_stride;
+
+  // Time steps between two balancings of the sub-boxes of the MPI ranks; 0
+  // keeps them equal.
+  long balance_stride;
+
+  // Output path; empty for a new path named by the date.
+  std::string output;
+
+  // Checkpoint to continue from; empty for a new simulation.
+  std::string restart;
+
+  // Force kernel, one of the kernel names or "auto" for the best one.
+  std::string kernel;
+
+  // 1 if the force kernel calculates the pairs in single precision, else 0.
+  int mixed;
+
+  // True if the benchmark should run instead of a simulation.
+  bool benchmark;
+
+  // True if the energy drift of the force kernels should be checked instead
+  // of a simulation.
+  bool validate;
+
+  // 1 if the hardware counters should be read around the force
+  // calculation, else 0.
+  int counters;
+};
+
+/**
+ * \brief Positions, velocities and accelerations of all particles.
+ *
+ * The matrices are stored as structure of arrays: Every column holds one
+ * component of all particles, so x, y and z are separate contiguous streams
+ * on the heap. The number of rows is padded to a multiple of SIMD_WIDTH, so
+ * every column starts at a 64 byte border and vector loops can run over the
+ * padding, which is kept at zero. The rows may be sorted for a better use
+ * of the caches; every particle keeps its ID for the output. */
+struct Particles {
+  // Number of particles.
+  int n;
+
+  // Number of ghosts of other MPI ranks in the rows behind the particles;
+  // only their positions and IDs are kept.
+  int ghosts;
+
+  // Positions /m, velocities /(m/s) and accelerations /(m/s^2).
+  MatrixX3d mp, mv, ma;
+
+  // Accelerations of the outer forces of a multiple time step run, else
+  // zero /(m/s^2). ma holds the inner ones then.
+  MatrixX3d mo;
+
+  // Positions in single precision for the mixed precision force kernels,
+  // copied before every force calculation /m.
+  MatrixX3f mf;
+
+  // ID of the particle in every row, which is its row before any sorting.
+  std::vector<int> id;
+};
+
+/**
+ * \brief Borders and kind of the simulation box. */
+struct Box {
+  // Borders of the box /m.
+  double left, right, top, bottom, front, back;
+
+  // True if a limited and closed box should be simulated, else the box is
+  // periodic.
+  bool closed;
+};
+
+/**
+ * \brief Linked-cell list for the spatial decomposition of the box.
+ *
+ * The box is divided into cells with a side length of at least the cutoff
+ * radius, so every interaction partner of a particle lies in the same or one
+ * of the 26 surrounding cells. The particles of a cell are stored as a linked
+ * list: head holds the first particle of every cell and next the following
+ * particle of every particle (-1 marks the end). */
+struct CellList {
+  // Box that is divided into cells.
+  Box box;
+
+  // Number of cells per dimension.
+  int nx, ny, nz;
+
+  // Lower corner of the box /m.
+  double ox, oy, oz;
+
+  // Inverse side length of a cell per dimension /(1/m).
+  double ix, iy, iz;
+
+  // First particle of every cell and following particle of every particle.
+  std::vector<int> head, next;
+};
+
+/**
+ * \brief Verlet neighbour list of all pairs inside cutoff radius plus skin.
+ *
+ * For every particle pi the partners pj are stored in
+ * list[start[pi]] to list[start[pi + 1] - 1]. Every pair is stored once. */
+struct NeighbourList {
+  // Offsets of the partners of every particle into the list.
+  std::vector<int> start, list;
+
+  // Pairs found by the cell search before sorting them by particle and the
+  // next free place of every particle in the list while sorting. Both are
+  // kept between the builds to reuse their memory.
+  std::vector<int> pairs, fill;
+
+  // Positions of all particles at the time of the last build /m.
+  MatrixX3d mp0;
+
+  // Number of builds and sum of all list lengths for the run summary.
+  int builds;
+  long length;
+};
+
+/**
+ * \brief Buffers for sorting the particles, kept between the sortings. */
+struct Ordering {
+  // Key on the space filling curve and row of every particle.
+  std::vector<std::pair<uint64_t, int> > keys;
+
+  // Copy of one field and of the IDs of the particles before sorting.
+  MatrixX3d tmp;
+  std::vector<int> ids;
+};
+
+/**
+ * \brief Complete state of a simulation, as saved in a checkpoint. */
+struct State {
+  // Positions, velocities and accelerations of the particles.
+  Particles ps;
+
+  // Box of the simulation.
+  Box box;
+
+  // Number of finished time steps.
+  long step;
+
+  // Time step of the last sorting of the particles.
+  long sorted;
+
+  // Random number generator of the simulation.
+  std::default_random_engine generator;
+
+  // Neighbour list. Building it again from the positions of its last build
+  // gives exactly the same list.
+  NeighbourList nl;
+
+  // Borders of the sub-boxes of the MPI ranks per dimension; empty for a
+  // single rank.
+  std::vector<double> cuts[3];
+};
+
+/**
+ * \brief Header at the start of a checkpoint file.
+ *
+ * The header is followed by the positions, velocities, accelerations and
+ * outer accelerations of the particles and the positions of the last
+ * neighbour list build, each as the whole padded matrix of doubles in column
+ * order, and the IDs of the particles as 32 bit integers. The state of the
+ * random number generator follows as text and the borders of the sub-boxes
+ * of the MPI ranks as doubles, dims + 1 per dimension. */
+struct CheckpointHeader {
+  // Identification of the file format, "SIMLJCHK".
+  char magic[8];
+
+  // Version of the file format.
+  int32_t version;
+
+  // 1 if the box is closed, 0 if it is periodic.
+  int32_t closed;
+
+  // Number of particles and of rows of the matrices.
+  int64_t particles, rows;
+
+  // Number of finished time steps and time step of the last sorting.
+  int64_t step, sorted;
+
+  // Parameters of the simulation, which have to match on a restart.
+  double sigma, epsilon, mass, timestep, rcut, skin, rinner;
+  int32_t shift, respa;
+
+  // Length of the state of the random number generator.
+  int32_t generator;
+
+  // Number of sub-boxes of the MPI ranks per dimension; 0 for a single rank.
+  int32_t dims[3];
+
+  // Borders of the box: left, right, top, bottom, front and back /m.
+  double box[6];
+
+  // Number of neighbour list builds and sum of all list lengths.
+  int64_t builds, length;
+};
+
+/**
+ * \brief Header at the start of a binary trajectory file.
+ *
+ * All values are stored in the byte order of the writing machine. The header
+ * is followed by frames of equal size, so frame k starts at byte
+ * sizeof(TrajectoryHeader) + k * frame_size. Every frame holds the number of
+ * finished time steps as 64 bit integer, 0 for the initial state, the same
+ * as in the observables and the checkpoint. The x, y and z streams of one
+ * field follow. Every stream has one value per written particle with the given
+ * precision. Behind the last frame the time steps of all frames are repeated
+ * as index, so a reader can find a time step without reading the frames. */
+struct TrajectoryHeader {
+  // Identification of the file format, "SIMLJTRJ".
+  char magic[8];
+
+  // Version of the file format.
+  int32_t version;
+
+  // Bytes per value, 4 for float and 8 for double.
+  int32_t precision;
+
+  // Field in the frames, one of the FIELD_ values.
+  int32_t field;
+
+  // Time steps between two frames.
+  int32_t stride;
+
+  // First written particle and number of written particles.
+  int64_t first, particles;
+
+  // Number of frames and bytes per frame.
+  int64_t frames, frame_size;
+
+  // Position of the index of time steps in the file.
+  int64_t index;
+
+  // Single timestep for integration /s.
+  double timestep;
+
+  // Borders of the box: left, right, top, bottom, front and back /m.
+  double box[6];
+};
+
+/**
+ * \brief Binary trajectory file opened for writing. */
+struct Trajectory {
+  // Output stream of the file.
+  std::ofstream out;
+
+  // Header, written again on closing with the final number of frames.
+  TrajectoryHeader header;
+
+  // Time steps of all written frames for the index.
+  std::vector<int64_t> steps;
+
+  // Buffer for converting one stream to float.
+  std::vector<float> buffer;
+};
+
+/**
+ * \brief Background thread writing the trajectory files.
+ *
+ * The simulation copies the fields due in a time step into one of the
+ * snapshots and goes on while the thread writes them to the files. The
+ * snapshots are used in turn as a ring. If all of them still wait for the
+ * disk, the simulation waits for the next free one. */
+struct Writer {
+  // Time steps between two frames of every field; 0 if it is not written.
+  int strides[FIELDS];
+
+  // Trajectory files of the fields, only used by the thread.
+  Trajectory tr[FIELDS];
+
+  // First written particle and number of written particles.
+  int first, count;
+
+  // Mass of an atom for turning the accelerations into forces /kg.
+  double mass;
+
+  // True if the outer accelerations of a multiple time step run have to be
+  // added to the forces.
+  bool respa;
+
+  // Copies of the particles with positions, velocities and forces, the
+  // fields to write from them and the number of their time steps.
+  Particles snapshots[WRITER_BUFFERS];
+  int fields[WRITER_BUFFERS];
+  int64_t steps[WRITER_BUFFERS];
+
+  // Number of snapshots handed over to the thread and written by it.
+  long pushed, written;
+
+  // Number of times the simulation had to wait for a free snapshot.
+  long stalls;
+
+  // True if no more snapshots will follow.
+  bool done;
+
+  // Protection of the counters and the flag, and notification about their
+  // changes.
+  std::mutex mutex;
+  std::condition_variable cond;
+
+  std::thread thread;
+};
+
+// Phases of a time step measured by the timers.
+#define PHASE_FORCES 0
+#define PHASE_NEIGHBOURS 1
+#define PHASE_INTEGRATION 2
+#define PHASE_BOUNDARY 3
+#define PHASE_OUTPUT 4
+#define PHASE_COMMUNICATION 5
+#define PHASES 6
+
+/**
+ * \brief Wall clock timers of the phases of the time steps.
+ *
+ * The loop reads the clock once at the end of every phase and adds the time
+ * since the last reading to the phase, so the phases cover the loop without
+ * gaps. */
+struct Timers {
+  // Wall time spent in every phase /s.
+  double phases[PHASES];
+
+  // Wall time of the whole simulation including its setup /s.
+  double total;
+
+  // Number of measured time steps.
+  long steps;
+
+  // Start of the simulation and last reading of the clock.
+  std::chrono::steady_clock::time_point start, last;
+};
+
+// Hardware events counted around the force calculation. The floating point
+// instructions are only known for Intel processors.
+#define COUNTER_CYCLES 0
+#define COUNTER_INSTRUCTIONS 1
+#define COUNTER_CACHE_MISSES 2
+#define COUNTER_FP_SCALAR 3
+#define COUNTER_FP_VECTOR 4
+#define COUNTERS 5
+
+/**
+ * \brief Hardware performance counters of the force calculation.
+ *
+ * Every thread of the force calculation opens its own group of counters,
+ * led by the cycles, because a counter only sees the thread that opened it.
+ * The groups are switched on and off together around every force
+ * calculation. */
+struct Counters {
+  // Number of threads with counters.
+  int threads;
+
+  // File descriptors of the events of every thread in the order the threads
+  // opened them, COUNTERS per thread; -1 if the event could not be opened.
+  std::vector<int> fds;
+
+  // Number of the counting, so a thread knows whether it opened its
+  // counters already; 0 if nothing is counted.
+  long id;
+
+  // True while the counters are switched on.
+  bool enabled;
+
+  // Values of the events summed up over all threads; -1 if the event was not
+  // counted.
+  long long values[COUNTERS];
+
+  // Number of pairs of the neighbour list handled while counting.
+  long long pairs;
+};
+
+/**
+ * \brief Spatial domain decomposition of the box over the MPI ranks.
+ *
+ * The ranks form a grid and every rank owns the particles of one sub-box.
+ * Behind its own particles a rank keeps copies of the particles of the other
+ * ranks inside a halo of the list radius around its sub-box, the ghosts.
+ * They are exchanged with the neighbour ranks dimension by dimension, so the
+ * ghosts received in one dimension are passed on in the next one and the
+ * edges and corners of the halo are covered as well. In a periodic box the
+ * positions of the ghosts crossing the border are shifted by a box length.
+ *
+ * The ghosts are chosen at every build of the neighbour list, right after
+ * the particles that left their sub-box have moved to the new owner. Every
+ * ghost remembers its owner, so between the builds the positions go from
+ * the owners straight to their ghosts in one round of non-blocking messages
+ * after every move. The pairs of own particles are calculated while these
+ * are on their way. The accelerations of the ghosts go back the same way and
+ * are added to the owners. Without MPI or with a single rank nothing of this
+ * happens. */
+struct Domain {
+  // Rank of this process and number of ranks; 0 and 1 without MPI.
+  int rank, size;
+
+#ifdef USE_MPI
+  // Communicator of the grid of ranks, number of ranks and coordinate of this
+  // rank per dimension.
+  MPI_Comm comm;
+  int dims[3], coords[3];
+
+  // Neighbour ranks below and above per dimension; MPI_PROC_NULL at the
+  // border of a closed box.
+  int lower[3], upper[3];
+
+  // Borders of the sub-boxes per dimension, dims + 1 each /m. The inner ones
+  // are moved by domain_balance().
+  std::vector<double> cuts[3];
+
+  // Box of the whole system and width of the halo /m.
+  Box box;
+  double halo;
+
+  // Ranks the own particles are sent to in the order of the ranks, and the
+  // rows sent to every one of them in sends[sstart[p]] to
+  // sends[sstart[p + 1] - 1]. This rank is one of them for the images in a
+  // periodic box.
+  std::vector<int> speers, sstart, sends;
+
+  // Ranks owning the ghosts in the order of the ranks, and the ghosts
+  // received from every one of them in recvs[rstart[p]] to
+  // recvs[rstart[p + 1] - 1].
+  std::vector<int> rpeers, rstart, recvs;
+
+  // Shift of the position of every ghost from its owner /m, three per ghost.
+  std::vector<double> shifts;
 
-// Define csv format for eigen
-const static IOFormat CSVFormat(StreamPrecision, DontAlignCols, ", ", "\n");
+  // Requests of the messages on their way.
+  std::vector<MPI_Request> requests;
+
+  // Buffers of the exchanges, kept between the steps.
+  std::vector<double> sbuf, rbuf;
+#endif
+
+  // True while the positions of the ghosts are on their way.
+  bool pending;
+
+  // Wall time spent waiting for the positions of the ghosts /s.
+  double waited;
+};
 
 // Constant variables and information.
 const char * const __version__ = "1.0";
 const char * const __author__ = "Christian Krippendorf";
 const char * const __email__ = "Coding@Christian-Krippendorf.de";
 
+#ifdef CHECK_ALLOCATIONS
+// Number of heap allocations of all threads in the allocation check, the
+// threads of the force calculation included. The time step loop checks that
+// it does not change while the buffers are reused.
+static std::atomic<long> allocations(0);
+
+// True on a thread whose allocations do not count. The writer thread
+// allocates in the file streams at any time, not for the time steps.
+static thread_local bool uncounted = false;
+
+// Number of time steps that allocated without a rebuild of the neighbour
+// list, and with one. A rebuild may enlarge the matrices and lists for more
+// particles, ghosts and pairs, so only the first number fails the check.
+static long allocating = 0, rebuilding = 0;
+
+void *operator new(std::size_t size) {
+  if (!uncounted)
+    allocations++;
+  if (void *p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+  std::free(p);
+}
+#endif
+
 /** 
- * \brief Manipulate the position and velocity matrices for border conditions.
- * \param[in] mp Reference to the position matrix of all particles /m.
- * \param[in] mv Reference to the velocity matrix of all particles /(m/s).
- * \param[in] closed True if a limited and closed box should be simulated, 
- *            else false. If it is not closed an algorithm put every particle 
- *            on the opposit site on reaching the border.
- * \param[in] left Left border of the box /m.
- * \param[in] right Right border of the box /m.
- * \param[in] top Top border of the box /m.
- * \param[in] bottom Bottom border of the box /m.
- * \param[in] front Front border of the box /m.
- * \param[in] back Back border of the box /m. */
-void boundary(Matrix3Td &mp, Matrix3Td &mv, bool closed, double left,
-  double right, double top, double bottom, double front, double back) {
-  if (closed) {
-    // If one of the particles reaches the end of the box, the velocity has to
-    // be reverted (multiplication with -1). The only problem is to decide with
-    // component of the vector has to be inverted.
+ * \brief Allocate the storage for a number of particles.
+ * \param[out] ps Reference to the particles.
+ * \param[in] n Number of particles. */
+void particles_init(Particles &ps, int n) {
+  int rows = (n + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+
+  ps.n = n;
+  ps.ghosts = 0;
+  ps.mp.setZero(rows, 3);
+  ps.mv.setZero(rows, 3);
+  ps.ma.setZero(rows, 3);
+  ps.mo.setZero(rows, 3);
+  ps.mf.setZero(rows, 3);
+
+  ps.id.resize(n);
+  for (int pi = 0; pi < n; pi++)
+    ps.id[pi] = pi;
+}
+
+/** 
+ * \brief Make room for more rows of particles and ghosts.
+ *
+ * The existing rows are kept and new rows start at zero. The storage never
+ * shrinks, so it is enlarged only a few times in a run.
+ *
+ * \param[in,out] ps Reference to the particles.
+ * \param[in] count Number of rows needed at least. */
+void particles_reserve(Particles &ps, int count) {
+  int rows = (count + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+  int old = ps.mp.rows();
+  if (rows <= old)
+    return;
+
+  MatrixX3d *fields[4] = {&ps.mp, &ps.mv, &ps.ma, &ps.mo};
+  for (int f = 0; f < 4; f++) {
+    fields[f]->conservativeResize(rows, 3);
+    fields[f]->bottomRows(rows - old).setZero();
+  }
+  ps.mf.setZero(rows, 3);
+}
 
-    // Go throught all particle and search for a position which is outside the
-    // box.
-    for (int pi = 0; pi < mp.cols(); pi++) {
-      if (mp(0, pi) > right || mp(0, pi) < left)
-        mv(0, pi) *= -1;
+/** 
+ * \brief Manipulate the position and velocity matrices for border conditions.
+ * \param[in,out] ps Reference to the particles; positions /m and velocities
+ *                   /(m/s) are changed.
+ * \param[in] box Reference to the box. If it is not closed an algorithm put
+ *                every particle on the opposit site on reaching the border. */
+void boundary(Particles &ps, const Box &box) {
+  // Borders of the box per dimension.
+  const double lo[3] = {box.left, box.bottom, box.front};
+  const double hi[3] = {box.right, box.top, box.back};
 
-      if (mp(1, pi) > top || mp(1, pi) < bottom)
-        mv(1, pi) *= -1;
+  // Handle every component stream on its own.
+  for (int d = 0; d < 3; d++) {
+    double *x = ps.mp.col(d).data();
+    double *v = ps.mv.col(d).data();
 
-      if (mp(2, pi) > back || mp(2, pi) < front)
-        mv(2, pi) *= -1;
+    if (box.closed) {
+      // If one of the particles reaches the end of the box, the velocity has
+      // to be reverted (multiplication with -1) in the direction of the
+      // border that has been crossed.
+      for (int pi = 0; pi < ps.n; pi++)
+        if (x[pi] > hi[d] || x[pi] < lo[d])
+          v[pi] *= -1;
+    } else {
+      // In a periodic box a particle leaving on one side enters again on the
+      // opposite side, so it is moved by whole box lengths.
+      double l = hi[d] - lo[d];
+      for (int pi = 0; pi < ps.n; pi++)
+        x[pi] -= l * std::floor((x[pi] - lo[d]) / l);
     }
   }
 }
 
+/** 
+ * \brief Apply the minimum image convention to a distance vector.
+ *
+ * In a periodic box the distance vector is changed to the nearest image of
+ * the other particle. In a closed box nothing happens.
+ *
+ * \param[in,out] dx X component of the distance vector /m.
+ * \param[in,out] dy Y component of the distance vector /m.
+ * \param[in,out] dz Z component of the distance vector /m.
+ * \param[in] box Reference to the box. */
+inline void minimum_image(double &dx, double &dy, double &dz,
+  const Box &box) {
+  if (box.closed)
+    return;
+
+  double lx = box.right - box.left, ly = box.top - box.bottom,
+    lz = box.back - box.front;
+
+  dx -= lx * std::nearbyint(dx / lx);
+  dy -= ly * std::nearbyint(dy / ly);
+  dz -= lz * std::nearbyint(dz / lz);
+}
+
+/** 
+ * \brief Calculate the squared distance of two particles.
+ * \param[in] mp Reference to the position matrix of all particles /m.
+ * \param[in] pi Index of the first particle.
+ * \param[in] pj Index of the second particle.
+ * \param[in] box Reference to the box.
+ * \return Squared distance with the minimum image convention /m^2. */
+inline double distance2(const MatrixX3d &mp, int pi, int pj, const Box &box) {
+  double dx = mp(pj, 0) - mp(pi, 0), dy = mp(pj, 1) - mp(pi, 1),
+    dz = mp(pj, 2) - mp(pi, 2);
+  minimum_image(dx, dy, dz, box);
+  return dx*dx + dy*dy + dz*dz;
+}
+
 /** 
  * \brief Initialize the velocities of the particles.
  *
@@ -112,21 +865,23 @@ void boundary(Matrix3Td &mp, Matrix3Td &mv, bool closed, double left,
  * This is just another version of component-wise normal distribution, which
  * will be implemented here.
  *
- * \param[out] mv Reference to the velocity matrix of all particles. */
-void init_velocities(Matrix3Td &mv) {
+ * \param[out] ps Reference to the particles, whose velocities are set.
+ * \param[in,out] generator Random number generator of the simulation.
+ * \param[in] pa Parameters of the simulation. */
+void init_velocities(Particles &ps, std::default_random_engine &generator,
+  const Parameters &pa) {
   // Calculation of the mid velocity for the particle.
-  double v = std::pow(8*KB*TEMP/PI/MASS, 1/2);
+  double v = std::pow(8*KB*pa.temp/PI/pa.mass, 1/2);
 
   // Create the normal distribution object for generating random velocity
   // numbers.
-  std::default_random_engine generator;
   std::normal_distribution<double> dist(v, v);
 
   // Calculate velocity components for every particle.
-  for (int pi = 0; pi < TOTAL_PARTICLE; pi++) {
-    mv(0, pi) = dist(generator);
-    mv(1, pi) = dist(generator);
-    mv(2, pi) = dist(generator);
+  for (int pi = 0; pi < ps.n; pi++) {
+    ps.mv(pi, 0) = dist(generator);
+    ps.mv(pi, 1) = dist(generator);
+    ps.mv(pi, 2) = dist(generator);
   }
 }
 
@@ -137,16 +892,15 @@ void init_velocities(Matrix3Td &mv) {
  * cube. Therefore the number of total particles should be the third power of
  * any natural number.
  *
- * \param[out] mp Reference to the position matrix of all particles. */
-void init_grid(Matrix3Td &mp) {
+ * \param[out] ps Reference to the particles, whose positions are set. */
+void init_grid(Particles &ps) {
   // Position variables for counting over the loops.
   int px = 0, py = 0, pz = 0;
 
-  // Total number of columns (particles).
-  int co = mp.cols();
+  // Total number of particles.
+  int co = ps.n;
 
-  // The number of rows gives the dimension. The number of columns gives the
-  // number of all particles. The number of particles per dimension side
+  // The number of particles per dimension side
   // should be the dimension root of the particle number. Otherwise the number
   // of particles is wrong.
   double po = cbrt(co);
@@ -155,9 +909,9 @@ void init_grid(Matrix3Td &mp) {
 
   // Got through all particle postitions and give them a position number.
   for (int pi = 0; pi < co; pi++) {
-    mp(0, pi) = px;
-    mp(1, pi) = py;
-    mp(2, pi) = pz;
+    ps.mp(pi, 0) = px;
+    ps.mp(pi, 1) = py;
+    ps.mp(pi, 2) = pz;
 
     // If the x position is a multiple of po value, reset the px value to
     // zero and increase the y position. The same calculation follows with
@@ -175,207 +929,4644 @@ void init_grid(Matrix3Td &mp) {
 }
 
 /** 
- * \brief Calculate the Lennard-Jones potential energy force for all particles.
- * \param[in] vp Reference to the vector object of the particle to calculate the
- *               final force for.
- * \param[in] mp Reference to the matrix object of all surrounding particles.
- * \param[out] mpo Reference to the matrix object where the final force will be
- *                 stored. */
-void lenjon_force(const Vector3d &vp, const MatrixXd &mp, Matrix3Td &mpo) {
-  // Get distance between the main particle and all surrounding particles.
-  MatrixXd rp = mp-vp.replicate(1, mp.cols());
-
-  // Calculate the distance of the particles by the norm.
-  ArrayXd rpn0 = rp.colwise().norm();
-  
-  // Calculate the resulting forces as magnitude.
-  ArrayXd rpn1 = SIGMA/rpn0;
-  rpn1 = -24*EPSILON*(2*rpn1.pow(7.0)-rpn1.pow(13.0));
+ * \brief Calculate the plain Lennard-Jones potential of two particles.
+ * \param[in] r2 Squared distance of the particles /m^2.
+ * \param[in] pa Parameters of the simulation.
+ * \return Potential energy /J. */
+inline double lenjon_u(double r2, const Parameters &pa) {
+  double s2 = pa.sigma*pa.sigma/r2;
+  double s6 = s2*s2*s2;
+  return 4*pa.epsilon*(s6*s6-s6);
+}
 
-  // Go back to the component wise view.
-  mpo.block(0, 0, 3, mp.cols()) = rp.array().rowwise()*(rpn1/rpn0).transpose();
+/** 
+ * \brief Calculate the plain Lennard-Jones force of two particles divided by
+ *        their distance.
+ * \param[in] r2 Squared distance of the particles /m^2.
+ * \param[in] pa Parameters of the simulation.
+ * \return Magnitude of the force divided by the distance; positive values
+ *         are repulsive /(N/m). */
+inline double lenjon_fr(double r2, const Parameters &pa) {
+  double s2 = pa.sigma*pa.sigma/r2;
+  double s6 = s2*s2*s2;
+  return 24*pa.epsilon*(2*s6*s6-s6)/r2;
 }
 
 /** 
- * \brief Calculation of the particle accelerations based on the resulting 
- *        forces.
- * \param[in] mp Matrix object for the positions with 3 rows and n columns.
- * \param[out] ma Matrix object for accelerations with 3 rows and n columns. */
-void accel(const Matrix3Td &mp, Matrix3Td &ma) {
-  // Temporary variables for calculation.
-  Matrix3Td mpo;
-  int pc;
+ * \brief Calculate the truncated Lennard-Jones force between two particles.
+ *
+ * The force is computed from the squared distance only; a square root is
+ * needed for the force shift alone.
+ *
+ * \param[in] r2 Squared distance of the particles, less than the squared
+ *               cutoff radius /m^2.
+ * \param[in] pa Parameters of the simulation.
+ * \return Magnitude of the force divided by the distance shifted as given by
+ *         the parameters; positive values are repulsive /(N/m). */
+inline double lenjon_force(double r2, const Parameters &pa) {
+  double fr = lenjon_fr(r2, pa);
 
-  // Empty the acceleration matrix.
-  ma.fill(0);
+  if (pa.shift == SHIFT_FORCE) {
+    // Subtract the force at the cutoff radius.
+    const double rc = pa.rcut*pa.sigma;
+    fr -= lenjon_fr(rc*rc, pa)*rc/std::sqrt(r2);
+  }
 
-  for (int pi = 0; pi < TOTAL_PARTICLE; pi++) {
-    // Calculate the number of particles from pi + 1 to the end of the matrix.
-    pc = TOTAL_PARTICLE - (pi + 1);
+  return fr;
+}
 
-    // Calculation of the Lennard-Jones force for one particle to the following
-    // particles.
-    lenjon_force(mp.col(pi), mp.block(0, pi + 1, 3, pc), mpo);
+/** 
+ * \brief Calculate the truncated Lennard-Jones potential of two particles.
+ * \param[in] r2 Squared distance of the particles, less than the squared
+ *               cutoff radius /m^2.
+ * \param[in] pa Parameters of the simulation.
+ * \return Potential energy shifted as given by the parameters /J. */
+double lenjon_potential(double r2, const Parameters &pa) {
+  const double rc = pa.rcut*pa.sigma;
+  double u = lenjon_u(r2, pa);
 
-    // Devide the forces throught the mass for getting the acceleration.
-    mpo.block(0, 0, 3, pc) *= 1/MASS;
+  if (pa.shift == SHIFT_ENERGY)
+    u -= lenjon_u(rc*rc, pa);
+  else if (pa.shift == SHIFT_FORCE)
+    u += -lenjon_u(rc*rc, pa) + (std::sqrt(r2)-rc)*lenjon_fr(rc*rc, pa)*rc;
 
-    // Set the total force for the pi-th particle.
-    ma.col(pi) += mpo.block(0, 0, 3, pc).rowwise().sum();
+  return u;
+}
 
-    // Cause of the third Newton's-Law every force can be used for the other
-    // particles.
-    ma.block(0, pi + 1, 3, pc) -= mpo.block(0, 0, 3, pc);
-  }
+/** 
+ * \brief Calculate the truncated Lennard-Jones acceleration of a particle
+ *        divided by the distance to its partner.
+ *
+ * The constants are given by the force kernels, so they fold into the code
+ * when they are known at compile time.
+ *
+ * \tparam Shifted True if the force is shifted at the cutoff radius.
+ * \param[in] r2 Squared distance of the particles /m^2.
+ * \param[in] sig2 Squared sigma /m^2.
+ * \param[in] c24 24 times epsilon divided by the mass /(J/kg).
+ * \param[in] fc Force at the cutoff radius times the cutoff radius divided
+ *               by the mass /(m^2/s^2).
+ * \return Magnitude of the acceleration divided by the distance; positive
+ *         values are repulsive /(1/s^2). */
+template <bool Shifted>
+inline double lenjon_accel(double r2, double sig2, double c24, double fc) {
+  double ir2 = 1 / r2;
+  double s2 = sig2*ir2;
+  double s6 = s2*s2*s2;
+  double f = c24*ir2*s6*(2*s6-1);
+  if (Shifted)
+    f -= fc / std::sqrt(r2);
+  return f;
 }
 
 /** 
- * \brief Test whether a path exist or not.
- * \return True if path exist, else false. */
-bool path_exist(const char * const path) {
-  struct stat my_stat;
-  return (stat(path, &my_stat) == 0);
+ * \brief Calculate the truncated Lennard-Jones potential of two particles
+ *        from constants given by the force kernels.
+ * \tparam Shifted True if the force is shifted at the cutoff radius.
+ * \param[in] r2 Squared distance of the particles /m^2.
+ * \param[in] sig2 Squared sigma /m^2.
+ * \param[in] c4 4 times epsilon /J.
+ * \param[in] uc Potential at the cutoff radius, or zero if the energy is not
+ *               shifted /J.
+ * \param[in] rc Cutoff radius /m.
+ * \param[in] fcu Force at the cutoff radius /N.
+ * \return Potential energy /J. */
+template <bool Shifted>
+inline double lenjon_energy(double r2, double sig2, double c4, double uc,
+  double rc, double fcu) {
+  double s2 = sig2/r2;
+  double s6 = s2*s2*s2;
+  double u = c4*s6*(s6-1) - uc;
+  if (Shifted)
+    u += (std::sqrt(r2)-rc)*fcu;
+  return u;
 }
 
 /** 
- * \brief Initialize serialization.
+ * \brief Calculate the share of a pair in a range of the force.
  *
- * Search for a saving path and create it if neccessary. This method should be
- * optimized throught a configuration file.
+ * A multiple time step run splits the force of every pair with the switching
+ * function S = 1 - x^2 (3 - 2 x) into S F for the inner and (1 - S) F for the
+ * outer range. x runs from zero to one through the switching shell inside
+ * the inner radius. It is taken linear in the squared distance, so no square
+ * root is needed, and the split stays smooth.
  *
- * \return Name of the output path. */
-std::string init_serialize() {
-  // Time data object for getting the raw data.
-  time_t rawtime;
-  struct tm *timeinfo;
+ * \tparam Range Range of the force, one of the RANGE_ values.
+ * \param[in] r2 Squared distance of the particles /m^2.
+ * \param[in] rs2 Squared start radius of the switching shell /m^2.
+ * \param[in] iw Inverse width of the switching shell in squared distances
+ *               /(1/m^2).
+ * \return Share of the force and the potential of the pair. */
+template <int Range>
+inline double respa_weight(double r2, double rs2, double iw) {
+  if (Range == RANGE_ALL)
+    return 1;
 
-  // String containing the time information in the right format.
-  char tbuf[80];
+  double x = std::min(std::max((r2 - rs2) * iw, 0.0), 1.0);
+  double w = 1 - x*x*(3 - 2*x);
+  return Range == RANGE_INNER ? w : 1 - w;
+}
 
-  // Get current datetime from the time object.
-  time(&rawtime);
-  timeinfo = localtime(&rawtime);
+/** 
+ * \brief Initialize the cell list for a box.
+ * \param[out] cl Reference to the cell list.
+ * \param[in] box Reference to the box.
+ * \param[in] rc Cutoff radius and therefore minimal side length of a cell /m. */
+void cells_init(CellList &cl, const Box &box, double rc) {
+  cl.box = box;
 
-  // Convert the datetime information to string.
-  strftime(tbuf, sizeof(tbuf), "%d-%m-%Y_%I-%M-%S", timeinfo);
+  // Use as many cells as possible while every side is at least rc long. A
+  // box smaller than rc gets one cell.
+  cl.nx = std::max(1, (int) ((box.right - box.left) / rc));
+  cl.ny = std::max(1, (int) ((box.top - box.bottom) / rc));
+  cl.nz = std::max(1, (int) ((box.back - box.front) / rc));
 
-  // Create final path as string with prefix.
-  std::string path = std::string("mds-") + std::string(tbuf) + std::string("/");
-  mkdir(path.c_str(), S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IWGRP |
-    S_IXGRP);
+  // The minimum image convention only sees the nearest image of a particle.
+  if (!box.closed && (cl.nx < 2 || cl.ny < 2 || cl.nz < 2))
+    std::cout << "Error: Periodic box smaller than twice the cutoff radius."
+	      << std::endl;
 
-  return path;
+  cl.ox = box.left;
+  cl.oy = box.bottom;
+  cl.oz = box.front;
+
+  cl.ix = cl.nx / (box.right - box.left);
+  cl.iy = cl.ny / (box.top - box.bottom);
+  cl.iz = cl.nz / (box.back - box.front);
+
+  cl.head.assign(cl.nx * cl.ny * cl.nz, -1);
+}
+
+/** 
+ * \brief Calculate the cell index of a coordinate in one dimension.
+ *
+ * Particles outside a closed box are put into the nearest border cell. This
+ * keeps the cell search correct, because such a particle is even further away
+ * from all cells that are not adjacent. In a periodic box the index is wrapped
+ * to the cell of the particle's image inside the box.
+ *
+ * \param[in] x Coordinate of the particle /m.
+ * \param[in] o Lower border of the box /m.
+ * \param[in] i Inverse side length of a cell /(1/m).
+ * \param[in] n Number of cells in this dimension.
+ * \param[in] closed True if the box is closed, else false.
+ * \return Index of the cell. */
+inline int cells_index(double x, double o, double i, int n, bool closed) {
+  int c = (int) std::floor((x - o) * i);
+  if (closed)
+    return std::min(std::max(c, 0), n - 1);
+  return ((c % n) + n) % n;
 }
 
 /** 
- * \brief Write the given matrices to file.
- * 
- * Get all references to the matrices and write them into a separate csv file
- * in the given path.
+ * \brief Find the neighbour cell in one dimension.
  *
- * \param[in] mp Matrix object for the positions with 3 rows and n columns.
- * \param[in] ma Matrix object for accelerations with 3 rows and n columns.
- * \param[in] mv Matrix object for velocties with 3 rows and n columns.
- * \param[in] count Number of loop; This gives information about the number of 
- *                  file to write in. */
-void write(const Matrix3Td &mp, const Matrix3Td &mv, const Matrix3Td &ma,
-	   const std::string &path, const int &count) {
-  // Open the output stream.
-  std::ofstream out((path + std::string("/mds-") + std::to_string(count) +
-		     std::string(".csv")).c_str());
+ * In a periodic box the cells on both ends are neighbours. With less than
+ * three cells every cell is a neighbour of every other cell anyway, so the
+ * index is not wrapped to avoid visiting a pair of cells twice.
+ *
+ * \param[in,out] c Index of the neighbour cell, possibly outside the box.
+ * \param[in] n Number of cells in this dimension.
+ * \param[in] closed True if the box is closed, else false.
+ * \return True if the neighbour cell exists, else false. */
+inline bool cells_neighbour(int &c, int n, bool closed) {
+  if (!closed && n >= 3)
+    c = (c + n) % n;
+  return c >= 0 && c < n;
+}
 
-  // Write data into the stream in an appropriate data format.
-  out << mp.transpose().format(CSVFormat);
+/** 
+ * \brief Sort all particles and ghosts into the cells.
+ * \param[in,out] cl Reference to the initialized cell list.
+ * \param[in] ps Reference to the particles. */
+void cells_build(CellList &cl, const Particles &ps) {
+  int rows = ps.n + ps.ghosts;
+  std::fill(cl.head.begin(), cl.head.end(), -1);
+  cl.next.resize(rows);
 
-  // Close the output stream.
-  out.close();
+  for (int pi = 0; pi < rows; pi++) {
+    bool closed = cl.box.closed;
+    int c = cells_index(ps.mp(pi, 0), cl.ox, cl.ix, cl.nx, closed) +
+      cl.nx * (cells_index(ps.mp(pi, 1), cl.oy, cl.iy, cl.ny, closed) +
+      cl.ny * cells_index(ps.mp(pi, 2), cl.oz, cl.iz, cl.nz, closed));
+
+    // Put the particle in front of the list of its cell.
+    cl.next[pi] = cl.head[c];
+    cl.head[c] = pi;
+  }
 }
 
 /** 
- * \brief Simulate the system by calculation with velocity verlet algorithm.
- * \param[in] mp Reference to the position matrix of all particles.
- * \param[in] mv Reference to the velocity matrix of all particles.
- * \param[in] ma Reference to the acceleration matrix of all particles. 
- * \param[in] serialize True if serialization wanted, else false. */
-void simulate(Matrix3Td &mp, Matrix3Td &mv, Matrix3Td &ma, bool serialize) {
-  // If serialization is wanted. Initialize the system to do so.
-  std::string path;
-  if (serialize)
-    path = init_serialize();
+ * \brief Add a pair found by the cell search.
+ *
+ * Pairs of two ghosts are left out. A pair of a particle and a ghost is kept
+ * on the rank of the particle with the lower ID only, so it is calculated
+ * once over all ranks. It is stored with the own particle first.
+ *
+ * \param[in,out] nl Reference to the neighbour list.
+ * \param[in] ps Reference to the particles.
+ * \param[in] pi First particle of the pair.
+ * \param[in] pj Second particle of the pair. */
+inline void neighbours_pair(NeighbourList &nl, const Particles &ps, int pi,
+  int pj) {
+  if (pi >= ps.n)
+    std::swap(pi, pj);
+  if (pi >= ps.n || (pj >= ps.n && ps.id[pj] < ps.id[pi]))
+    return;
 
-  // Calculate box borders from number of particles.
-  double po = cbrt(TOTAL_PARTICLE);
-  if (fmod(po, 1) != 0)
-    std::cout << std::endl << "Error: Wrong size of particles." << std::endl;
+  nl.pairs.push_back(pi);
+  nl.pairs.push_back(pj);
+}
 
-  // Temporary calculations that will be done here once instead of multiple
-  // times inside the loop.
-  double td205 = 0.5 * std::pow(TIMESTEP, 2);
-  double td05 = 0.5 * TIMESTEP;
+/** 
+ * \brief Build the neighbour list from the cell list.
+ *
+ * Only particles in the same or adjacent cells are compared. Every pair of
+ * cells is visited once by looking at the cell itself and half of its
+ * neighbours only; the other half is covered from the neighbour's side.
+ * Ghosts of other ranks only show up as partners, see neighbours_pair().
+ *
+ * \param[out] nl Reference to the neighbour list.
+ * \param[in,out] cl Cell list of the box, rebuilt for the given positions. The
+ *                   cells need a side length of at least cutoff plus skin.
+ * \param[in] ps Reference to the particles.
+ * \param[in] pa Parameters of the simulation. */
+void neighbours_build(NeighbourList &nl, CellList &cl, const Particles &ps,
+  const Parameters &pa) {
+  // Offsets of the half shell of neighbour cells.
+  static const int shell[13][3] = {
+    {1, 0, 0}, {-1, 1, 0}, {0, 1, 0}, {1, 1, 0}, {-1, -1, 1}, {0, -1, 1},
+    {1, -1, 1}, {-1, 0, 1}, {0, 0, 1}, {1, 0, 1}, {-1, 1, 1}, {0, 1, 1},
+    {1, 1, 1}};
 
-  // First calculation of the accelerations.
-  accel(mp, ma);
+  // Squared list radius for comparing without a square root.
+  const double rl2 = std::pow((pa.rcut + pa.skin) * pa.sigma, 2);
 
-  // Start the simulation process in a loop and informate the user about it.
-  std::cout << "\nSimulation running...\n" << std::flush;
+  // Sort the particles into the cells of the current positions.
+  cells_build(cl, ps);
 
-  // The whole simulation process runs inside a loop. The calculation is
-  // implemented with the Velocity-Störmer algorithm which is the most
-  // appropriate way of calculating in this term.
-  for (int ts = 0; ts < TOTAL_TIMESTEPS; ts++) {
-    mp = mp + mv*TIMESTEP + ma*td205;
-    accel(mp, ma);
-    mv += ma*td05;
+  nl.pairs.clear();
+  for (int cz = 0; cz < cl.nz; cz++)
+  for (int cy = 0; cy < cl.ny; cy++)
+  for (int cx = 0; cx < cl.nx; cx++) {
+    int c = cx + cl.nx * (cy + cl.ny * cz);
 
-    // Correct the velocities and/or positions related to the way of handling
-    // boundary conditions. They can be handled with periodic boundary or a closed
-    // volume like a box.
-    boundary(mp, mv, true, 0, po, 0, po, 0, po);
+    for (int pi = cl.head[c]; pi != -1; pi = cl.next[pi]) {
+      // Pairs inside the own cell. The following particles of the list are
+      // enough to count every pair once.
+      for (int pj = cl.next[pi]; pj != -1; pj = cl.next[pj]) {
+        if (distance2(ps.mp, pi, pj, cl.box) < rl2)
+          neighbours_pair(nl, ps, pi, pj);
+      }
 
-    // Write current state to file if wanted.
-    if (serialize)
-      write(mp, mv, ma, path, ts);
+      // Pairs with the particles of the neighbour cells.
+      for (int ni = 0; ni < 13; ni++) {
+        int nx = cx + shell[ni][0], ny = cy + shell[ni][1],
+          nz = cz + shell[ni][2];
+        if (!cells_neighbour(nx, cl.nx, cl.box.closed) ||
+            !cells_neighbour(ny, cl.ny, cl.box.closed) ||
+            !cells_neighbour(nz, cl.nz, cl.box.closed))
+          continue;
 
-    // Print progress.
-    std::cout << (int) 100.0 * ts / TOTAL_TIMESTEPS << "%\r" << std::flush;
+        int n = nx + cl.nx * (ny + cl.ny * nz);
+        for (int pj = cl.head[n]; pj != -1; pj = cl.next[pj]) {
+          if (distance2(ps.mp, pi, pj, cl.box) < rl2)
+            neighbours_pair(nl, ps, pi, pj);
+        }
+      }
+    }
   }
 
-  // The simulation has been finished! Informate the user about it.
-  std::cout << "finish!\n\n" << std::flush;
+  // Sort the pairs by their first particle with a counting sort, so every
+  // particle gets one contiguous part of the list.
+  int pc = nl.pairs.size() / 2;
+  nl.start.assign(ps.n + 1, 0);
+  for (int k = 0; k < pc; k++)
+    nl.start[nl.pairs[2 * k] + 1]++;
+  for (int pi = 0; pi < ps.n; pi++)
+    nl.start[pi + 1] += nl.start[pi];
+
+  nl.list.resize(pc);
+  nl.fill.assign(nl.start.begin(), nl.start.end() - 1);
+  for (int k = 0; k < pc; k++)
+    nl.list[nl.fill[nl.pairs[2 * k]]++] = nl.pairs[2 * k + 1];
+
+  // Remember the positions for the displacement check.
+  nl.mp0 = ps.mp;
+  nl.builds++;
+  nl.length += pc;
 }
 
 /** 
- * \brief Write short information about the application. */
-void app_info() {
+ * \brief Test whether the neighbour list might be outdated.
+ *
+ * The list stays valid as long as no particle moved more than half of the
+ * skin since the last build, because two particles can not come closer than
+ * the cutoff radius without being in the list before.
+ *
+ * \param[in] nl Reference to the neighbour list.
+ * \param[in] box Reference to the box.
+ * \param[in] ps Reference to the particles.
+ * \param[in] pa Parameters of the simulation.
+ * \return True if the list has to be rebuilt, else false. */
+bool neighbours_outdated(const NeighbourList &nl, const Box &box,
+  const Particles &ps, const Parameters &pa) {
+  const double dmax2 = std::pow(0.5 * pa.skin * pa.sigma, 2);
+
+  // Particles wrapped in a periodic box did not really move by a box length.
+  for (int pi = 0; pi < ps.n; pi++) {
+    double dx = ps.mp(pi, 0) - nl.mp0(pi, 0), dy = ps.mp(pi, 1) - nl.mp0(pi, 1),
+      dz = ps.mp(pi, 2) - nl.mp0(pi, 2);
+    minimum_image(dx, dy, dz, box);
+    if (dx*dx + dy*dy + dz*dz > dmax2)
+      return true;
+  }
+
+  return false;
+}
+
+/** 
+ * \brief Rebuild the neighbour list if it might be outdated.
+ * \param[in,out] nl Reference to the neighbour list.
+ * \param[in,out] cl Cell list of the box used for a rebuild.
+ * \param[in] ps Reference to the particles.
+ * \param[in] pa Parameters of the simulation.
+ * \return True if the list has been rebuilt, else false. */
+bool neighbours_update(NeighbourList &nl, CellList &cl, const Particles &ps,
+  const Parameters &pa) {
+  if (!neighbours_outdated(nl, cl.box, ps, pa))
+    return false;
+
+  neighbours_build(nl, cl, ps, pa);
+  return true;
+}
+
+/** 
+ * \brief Take the pairs of the inner range of a multiple time step run from
+ *        the neighbour list.
+ *
+ * The inner list holds the pairs closer than inner radius plus skin at the
+ * last build of the neighbour list, so it stays valid as long as the
+ * neighbour list does and comes out the same after a restart.
+ *
+ * \param[out] in Reference to the inner list; only start and list are set.
+ * \param[in] nl Reference to the neighbour list.
+ * \param[in] box Reference to the box.
+ * \param[in] ps Reference to the particles.
+ * \param[in] pa Parameters of the simulation. */
+void neighbours_inner(NeighbourList &in, const NeighbourList &nl,
+  const Box &box, const Particles &ps, const Parameters &pa) {
+  const double rl2 = std::pow((pa.rinner + pa.skin) * pa.sigma, 2);
+
+  in.start.resize(ps.n + 1);
+  in.list.clear();
+  for (int pi = 0; pi < ps.n; pi++) {
+    in.start[pi] = in.list.size();
+    for (int k = nl.start[pi]; k < nl.start[pi + 1]; k++) {
+      int pj = nl.list[k];
+      double dx = nl.mp0(pj, 0) - nl.mp0(pi, 0),
+        dy = nl.mp0(pj, 1) - nl.mp0(pi, 1), dz = nl.mp0(pj, 2) - nl.mp0(pi, 2);
+      minimum_image(dx, dy, dz, box);
+      if (dx*dx + dy*dy + dz*dz < rl2)
+        in.list.push_back(pj);
+    }
+  }
+  in.start[ps.n] = in.list.size();
+}
+
+/**
+ * \brief Split a neighbour list into the pairs of two own particles and the
+ *        pairs with a ghost.
+ *
+ * The first ones need no positions of other ranks and are calculated while
+ * these are on their way.
+ *
+ * \param[out] own Reference to the list of the pairs of own particles; only
+ *                 start and list are set.
+ * \param[out] halo Reference to the list of the pairs with a ghost; only
+ *                  start and list are set.
+ * \param[in] nl Reference to the neighbour list.
+ * \param[in] ps Reference to the particles. */
+void neighbours_split(NeighbourList &own, NeighbourList &halo,
+  const NeighbourList &nl, const Particles &ps) {
+  own.start.resize(ps.n + 1);
+  halo.start.resize(ps.n + 1);
+  own.list.clear();
+  halo.list.clear();
+  for (int pi = 0; pi < ps.n; pi++) {
+    own.start[pi] = own.list.size();
+    halo.start[pi] = halo.list.size();
+    for (int k = nl.start[pi]; k < nl.start[pi + 1]; k++) {
+      int pj = nl.list[k];
+      (pj < ps.n ? own : halo).list.push_back(pj);
+    }
+  }
+  own.start[ps.n] = own.list.size();
+  halo.start[ps.n] = halo.list.size();
+}
+
+/** 
+ * \brief Spread the lower 21 bits of a number to every third bit.
+ * \param[in] v Number to spread.
+ * \return Spread number. */
+inline uint64_t morton_spread(uint64_t v) {
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffffULL;
+  v = (v | v << 16) & 0x1f0000ff0000ffULL;
+  v = (v | v << 8) & 0x100f00f00f00f00fULL;
+  v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+  v = (v | v << 2) & 0x1249249249249249ULL;
+  return v;
+}
+
+/** 
+ * \brief Sort the particles along a Morton curve through the box.
+ *
+ * Particles close in space get close rows, so the partners of a particle in
+ * the force calculation are mostly in the caches already. The positions,
+ * velocities, accelerations and IDs are moved together. The neighbour list
+ * has to be built again afterwards.
+ *
+ * \param[in,out] ps Reference to the particles.
+ * \param[in] box Reference to the box.
+ * \param[in,out] ord Buffers of the sorting, kept between the calls. */
+void particles_sort(Particles &ps, const Box &box, Ordering &ord) {
+  const double lo[3] = {box.left, box.bottom, box.front};
+  const double hi[3] = {box.right, box.top, box.back};
+  const double cells = 1 << 21;
+
+  // Key of every particle from its position on a grid of 2^21 cells per
+  // dimension. Particles outside a closed box go to the border cells.
+  ord.keys.resize(ps.n);
+  for (int pi = 0; pi < ps.n; pi++) {
+    uint64_t key = 0;
+    for (int d = 0; d < 3; d++) {
+      double c = (ps.mp(pi, d) - lo[d]) / (hi[d] - lo[d]) * cells;
+      key |= morton_spread((uint64_t) std::min(std::max(c, 0.0), cells - 1))
+        << d;
+    }
+    ord.keys[pi] = std::make_pair(key, pi);
+  }
+  std::sort(ord.keys.begin(), ord.keys.end());
+
+  // Move every field to its new rows.
+  MatrixX3d *fields[4] = {&ps.mp, &ps.mv, &ps.ma, &ps.mo};
+  for (int f = 0; f < 4; f++) {
+    ord.tmp = *fields[f];
+    for (int d = 0; d < 3; d++)
+      for (int pi = 0; pi < ps.n; pi++)
+        (*fields[f])(pi, d) = ord.tmp(ord.keys[pi].second, d);
+  }
+
+  ord.ids = ps.id;
+  for (int pi = 0; pi < ps.n; pi++)
+    ps.id[pi] = ord.ids[ord.keys[pi].second];
+}
+
+/** 
+ * \brief Add the accelerations of the pairs of the neighbour list with plain
+ *        scalar code.
+ *
+ * This kernel runs on every machine and finishes the remaining pairs of the
+ * vector kernels.
+ *
+ * \tparam Reduced True for reduced units, where sigma, epsilon and mass are
+ *                 one.
+ * \tparam Closed True if the box is closed.
+ * \tparam Shifted True if the force is shifted at the cutoff radius.
+ * \tparam Energy True if the potential energy and the virial should be
+ *                summed up as well.
+ * \tparam Range Range of the force, one of the RANGE_ values. The inner
+ *               range ends at the inner radius.
+ * \param[in] ps Reference to the particles.
+ * \param[in] nl Neighbour list that is valid for the given positions.
+ * \param[in] box Reference to the box.
+ * \param[in] p0 First main particle to handle.
+ * \param[in] p1 Main particle behind the last one to handle.
+ * \param[in] pa Parameters of the simulation.
+ * \param[in,out] ma Matrix the accelerations are added to /(m/s^2).
+ * \param[in,out] sums Potential energy /J and virial divided by the mass
+ *                     /(m^2/s^2) the pairs are added to, if Energy is set. */
+template <bool Reduced, bool Closed, bool Shifted, bool Energy, int Range>
+void accel_generic(const Particles &ps, const NeighbourList &nl, const Box &box,
+  int p0, int p1, const Parameters &pa, MatrixX3d &ma, double *sums) {
+  // Constants of the force, known at compile time for reduced units.
+  const double sigma = Reduced ? 1.0 : pa.sigma,
+    epsilon = Reduced ? 1.0 : pa.epsilon, mass = Reduced ? 1.0 : pa.mass;
+  const double rc = pa.rcut * sigma, sig2 = sigma * sigma,
+    c24 = 24 * epsilon / mass,
+    fc = Shifted ? lenjon_fr(rc * rc, pa) * rc / mass : 0;
+
+  // Constants of the potential.
+  const double c4 = 4 * epsilon,
+    uc = pa.shift == SHIFT_NONE ? 0 : lenjon_u(rc * rc, pa),
+    fcu = Shifted ? lenjon_fr(rc * rc, pa) * rc : 0;
+
+  // Start of the switching shell of a multiple time step run and inverse of
+  // its width, in squared distances.
+  const double ri = pa.rinner * sigma, rs = ri - RESPA_SWITCH * sigma,
+    rs2 = rs * rs, iw = 1 / (ri * ri - rs2);
+
+  // Squared cutoff radius of the range for comparing without a square root.
+  const double rc2 = Range == RANGE_INNER ? ri * ri : rc * rc;
+
+  // Potential energy and virial of all pairs.
+  double u = 0, vir = 0;
+
+  // Component streams of the positions and accelerations.
+  const double *x = ps.mp.col(0).data(), *y = ps.mp.col(1).data(),
+    *z = ps.mp.col(2).data();
+  double *ax = ma.col(0).data(), *ay = ma.col(1).data(),
+    *az = ma.col(2).data();
+
+  for (int pi = p0; pi < p1; pi++) {
+    // Sum up the acceleration of the main particle locally.
+    double axi = 0, ayi = 0, azi = 0;
+
+    for (int k = nl.start[pi]; k < nl.start[pi + 1]; k++) {
+      int pj = nl.list[k];
+
+      // Pairs of the list may still be outside of the cutoff radius.
+      double dx = x[pj] - x[pi], dy = y[pj] - y[pi], dz = z[pj] - z[pi];
+      if (!Closed)
+        minimum_image(dx, dy, dz, box);
+      double r2 = dx*dx + dy*dy + dz*dz;
+
+      // Coincident particles have no direction and drop out, as in all
+      // kernels.
+      if (r2 < rc2 && r2 > 0) {
+        // Devide the force throught the mass for getting the acceleration. A
+        // repulsive force pushes the main particle away from the other one.
+        double w = respa_weight<Range>(r2, rs2, iw);
+        double f = lenjon_accel<Shifted>(r2, sig2, c24, fc) * w;
+        axi -= dx*f;
+        ayi -= dy*f;
+        azi -= dz*f;
+
+        if (Energy) {
+          u += lenjon_energy<Shifted>(r2, sig2, c4, uc, rc, fcu) * w;
+          vir += f*r2;
+        }
+
+        // Cause of the third Newton's-Law every force can be used for the
+        // other particle.
+        ax[pj] += dx*f;
+        ay[pj] += dy*f;
+        az[pj] += dz*f;
+      }
+    }
+
+    ax[pi] += axi;
+    ay[pi] += ayi;
+    az[pi] += azi;
+  }
+
+  if (Energy) {
+    sums[0] += u;
+    sums[1] += vir;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/** 
+ * \brief Add the accelerations of the pairs of the neighbour list with AVX2.
+ *
+ * Four partners of a particle are handled at once. Their positions are
+ * gathered from the component streams; the accelerations of the partners are
+ * added one by one, because AVX2 has no scatter instruction. The force is
+ * calculated from the squared distance with multiplications only.
+ *
+ * \tparam Reduced True for reduced units, where sigma, epsilon and mass are
+ *                 one.
+ * \tparam Closed True if the box is closed.
+ * \tparam Shifted True if the force is shifted at the cutoff radius.
+ * \tparam Energy True if the potential energy and the virial should be
+ *                summed up as well.
+ * \tparam Range Range of the force, one of the RANGE_ values. The inner
+ *               range ends at the inner radius.
+ * \param[in] ps Reference to the particles.
+ * \param[in] nl Neighbour list that is valid for the given positions.
+ * \param[in] box Reference to the box.
+ * \param[in] p0 First main particle to handle.
+ * \param[in] p1 Main particle behind the last one to handle.
+ * \param[in] pa Parameters of the simulation.
+ * \param[in,out] ma Matrix the accelerations are added to /(m/s^2).
+ * \param[in,out] sums Potential energy /J and virial divided by the mass
+ *                     /(m^2/s^2) the pairs are added to, if Energy is set. */
+template <bool Reduced, bool Closed, bool Shifted, bool Energy, int Range>
+__attribute__((target("avx2,fma")))
+void accel_avx2(const Particles &ps, const NeighbourList &nl, const Box &box,
+  int p0, int p1, const Parameters &pa, MatrixX3d &ma, double *sums) {
+  // Constants of the force, known at compile time for reduced units.
+  const double sigma = Reduced ? 1.0 : pa.sigma,
+    epsilon = Reduced ? 1.0 : pa.epsilon, mass = Reduced ? 1.0 : pa.mass;
+  const double rc = pa.rcut * sigma, fcs = Shifted ?
+    lenjon_fr(rc * rc, pa) * rc / mass : 0;
+
+  // Constants of the force for all lanes.
+  const double ri = pa.rinner * sigma, rs = ri - RESPA_SWITCH * sigma,
+    rcs2 = Range == RANGE_INNER ? ri * ri : rc * rc, rss2 = rs * rs,
+    iws = 1 / (ri * ri - rss2);
+  const __m256d rc2 = _mm256_set1_pd(rcs2);
+  const __m256d sig2 = _mm256_set1_pd(sigma * sigma);
+  const __m256d c24 = _mm256_set1_pd(24 * epsilon / mass);
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d fc = _mm256_set1_pd(fcs);
+
+  // Constants of the switching shell of a multiple time step run.
+  const __m256d rs2 = _mm256_set1_pd(rss2), iw = _mm256_set1_pd(iws),
+    two = _mm256_set1_pd(2.0), three = _mm256_set1_pd(3.0);
+
+  // Constants of the potential.
+  const double ucs = pa.shift == SHIFT_NONE ? 0 : lenjon_u(rc * rc, pa),
+    fcus = Shifted ? lenjon_fr(rc * rc, pa) * rc : 0;
+  const __m256d c4 = _mm256_set1_pd(4 * epsilon), uc = _mm256_set1_pd(ucs),
+    fcu = _mm256_set1_pd(fcus), rcv = _mm256_set1_pd(rc);
+
+  // Potential energy and virial of all pairs, in lanes and one by one.
+  __m256d uv = _mm256_setzero_pd(), virv = _mm256_setzero_pd();
+  double u = 0, vir = 0;
+
+  // Box lengths and their inverse for the minimum image convention.
+  const __m256d lx = _mm256_set1_pd(box.right - box.left),
+    ly = _mm256_set1_pd(box.top - box.bottom),
+    lz = _mm256_set1_pd(box.back - box.front);
+  const __m256d ilx = _mm256_div_pd(one, lx), ily = _mm256_div_pd(one, ly),
+    ilz = _mm256_div_pd(one, lz);
+
+  // Component streams of the positions and accelerations.
+  const double *x = ps.mp.col(0).data(), *y = ps.mp.col(1).data(),
+    *z = ps.mp.col(2).data();
+  double *ax = ma.col(0).data(), *ay = ma.col(1).data(),
+    *az = ma.col(2).data();
+
+  alignas(32) double fx[4], fy[4], fz[4];
+
+  for (int pi = p0; pi < p1; pi++) {
+    const __m256d xi = _mm256_set1_pd(x[pi]), yi = _mm256_set1_pd(y[pi]),
+      zi = _mm256_set1_pd(z[pi]);
+    __m256d axi = _mm256_setzero_pd(), ayi = _mm256_setzero_pd(),
+      azi = _mm256_setzero_pd();
+
+    int k = nl.start[pi], end = nl.start[pi + 1];
+    for (; k + 4 <= end; k += 4) {
+      const __m128i pj = _mm_loadu_si128((const __m128i *) &nl.list[k]);
+
+      __m256d dx = _mm256_sub_pd(_mm256_i32gather_pd(x, pj, 8), xi);
+      __m256d dy = _mm256_sub_pd(_mm256_i32gather_pd(y, pj, 8), yi);
+      __m256d dz = _mm256_sub_pd(_mm256_i32gather_pd(z, pj, 8), zi);
+
+      if (!Closed) {
+        const int mode = _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC;
+        dx = _mm256_fnmadd_pd(lx, _mm256_round_pd(_mm256_mul_pd(dx, ilx),
+          mode), dx);
+        dy = _mm256_fnmadd_pd(ly, _mm256_round_pd(_mm256_mul_pd(dy, ily),
+          mode), dy);
+        dz = _mm256_fnmadd_pd(lz, _mm256_round_pd(_mm256_mul_pd(dz, ilz),
+          mode), dz);
+      }
+
+      __m256d r2 = _mm256_fmadd_pd(dz, dz, _mm256_fmadd_pd(dy, dy,
+        _mm256_mul_pd(dx, dx)));
+
+      // Acceleration divided by the distance, zero outside the cutoff radius.
+      __m256d ir2 = _mm256_div_pd(one, r2);
+      __m256d s2 = _mm256_mul_pd(sig2, ir2);
+      __m256d s6 = _mm256_mul_pd(_mm256_mul_pd(s2, s2), s2);
+      __m256d f = _mm256_mul_pd(_mm256_mul_pd(c24, ir2),
+        _mm256_mul_pd(s6, _mm256_fmsub_pd(s6, two, one)));
+      if (Shifted)
+        f = _mm256_sub_pd(f, _mm256_div_pd(fc, _mm256_sqrt_pd(r2)));
+
+      // Share of the pairs in the range, see respa_weight().
+      __m256d w = one;
+      if (Range != RANGE_ALL) {
+        __m256d xs = _mm256_min_pd(_mm256_max_pd(_mm256_mul_pd(
+          _mm256_sub_pd(r2, rs2), iw), _mm256_setzero_pd()), one);
+        w = _mm256_fnmadd_pd(_mm256_mul_pd(xs, xs),
+          _mm256_fnmadd_pd(two, xs, three), one);
+        if (Range == RANGE_OUTER)
+          w = _mm256_sub_pd(one, w);
+        f = _mm256_mul_pd(f, w);
+      }
+      // Coincident particles drop out, as in the other kernels.
+      const __m256d in = _mm256_and_pd(_mm256_cmp_pd(r2, rc2, _CMP_LT_OQ),
+        _mm256_cmp_pd(r2, _mm256_setzero_pd(), _CMP_GT_OQ));
+      f = _mm256_and_pd(f, in);
+
+      if (Energy) {
+        __m256d up = _mm256_fmsub_pd(_mm256_mul_pd(c4, s6),
+          _mm256_sub_pd(s6, one), uc);
+        if (Shifted)
+          up = _mm256_fmadd_pd(_mm256_sub_pd(_mm256_sqrt_pd(r2), rcv), fcu,
+            up);
+        if (Range != RANGE_ALL)
+          up = _mm256_mul_pd(up, w);
+        uv = _mm256_add_pd(uv, _mm256_and_pd(up, in));
+        virv = _mm256_fmadd_pd(f, r2, virv);
+      }
+
+      // A repulsive force pushes the main particle away from the other one.
+      __m256d fxv = _mm256_mul_pd(dx, f), fyv = _mm256_mul_pd(dy, f),
+        fzv = _mm256_mul_pd(dz, f);
+      axi = _mm256_sub_pd(axi, fxv);
+      ayi = _mm256_sub_pd(ayi, fyv);
+      azi = _mm256_sub_pd(azi, fzv);
+
+      // Cause of the third Newton's-Law every force can be used for the
+      // other particle.
+      _mm256_store_pd(fx, fxv);
+      _mm256_store_pd(fy, fyv);
+      _mm256_store_pd(fz, fzv);
+      for (int l = 0; l < 4; l++) {
+        int j = nl.list[k + l];
+        ax[j] += fx[l];
+        ay[j] += fy[l];
+        az[j] += fz[l];
+      }
+    }
+
+    // Sum up the lanes of the main particle.
+    _mm256_store_pd(fx, axi);
+    _mm256_store_pd(fy, ayi);
+    _mm256_store_pd(fz, azi);
+    double axs = fx[0] + fx[1] + fx[2] + fx[3],
+      ays = fy[0] + fy[1] + fy[2] + fy[3], azs = fz[0] + fz[1] + fz[2] + fz[3];
+
+    // The remaining partners are handled one by one.
+    for (; k < end; k++) {
+      int j = nl.list[k];
+      double dx = x[j] - x[pi], dy = y[j] - y[pi], dz = z[j] - z[pi];
+      if (!Closed)
+        minimum_image(dx, dy, dz, box);
+      double r2 = dx*dx + dy*dy + dz*dz;
+      if (r2 < rcs2 && r2 > 0) {
+        double w = respa_weight<Range>(r2, rss2, iws);
+        double f = lenjon_accel<Shifted>(r2, sigma * sigma,
+          24 * epsilon / mass, fcs) * w;
+        axs -= dx*f;
+        ays -= dy*f;
+        azs -= dz*f;
+        ax[j] += dx*f;
+        ay[j] += dy*f;
+        az[j] += dz*f;
+
+        if (Energy) {
+          u += lenjon_energy<Shifted>(r2, sigma * sigma, 4 * epsilon, ucs, rc,
+            fcus) * w;
+          vir += f*r2;
+        }
+      }
+    }
+
+    ax[pi] += axs;
+    ay[pi] += ays;
+    az[pi] += azs;
+  }
+
+  if (Energy) {
+    _mm256_store_pd(fx, uv);
+    _mm256_store_pd(fy, virv);
+    sums[0] += u + fx[0] + fx[1] + fx[2] + fx[3];
+    sums[1] += vir + fy[0] + fy[1] + fy[2] + fy[3];
+  }
+}
+
+/** 
+ * \brief Add the accelerations of the pairs of the neighbour list with
+ *        AVX-512.
+ *
+ * Eight partners of a particle are handled at once. The partners of one
+ * particle are different, so their accelerations can be gathered, added and
+ * scattered back without conflicts. The remaining partners are handled with
+ * a masked vector.
+ *
+ * \tparam Reduced True for reduced units, where sigma, epsilon and mass are
+ *                 one.
+ * \tparam Closed True if the box is closed.
+ * \tparam Shifted True if the force is shifted at the cutoff radius.
+ * \tparam Energy True if the potential energy and the virial should be
+ *                summed up as well.
+ * \tparam Range Range of the force, one of the RANGE_ values. The inner
+ *               range ends at the inner radius.
+ * \param[in] ps Reference to the particles.
+ * \param[in] nl Neighbour list that is valid for the given positions.
+ * \param[in] box Reference to the box.
+ * \param[in] p0 First main particle to handle.
+ * \param[in] p1 Main particle behind the last one to handle.
+ * \param[in] pa Parameters of the simulation.
+ * \param[in,out] ma Matrix the accelerations are added to /(m/s^2).
+ * \param[in,out] sums Potential energy /J and virial divided by the mass
+ *                     /(m^2/s^2) the pairs are added to, if Energy is set. */
+template <bool Reduced, bool Closed, bool Shifted, bool Energy, int Range>
+__attribute__((target("avx512f")))
+void accel_avx512(const Particles &ps, const NeighbourList &nl, const Box &box,
+  int p0, int p1, const Parameters &pa, MatrixX3d &ma, double *sums) {
+  // Constants of the force, known at compile time for reduced units.
+  const double sigma = Reduced ? 1.0 : pa.sigma,
+    epsilon = Reduced ? 1.0 : pa.epsilon, mass = Reduced ? 1.0 : pa.mass;
+  const double rc = pa.rcut * sigma, fcs = Shifted ?
+    lenjon_fr(rc * rc, pa) * rc / mass : 0;
+
+  // Constants of the force for all lanes.
+  const double ri = pa.rinner * sigma, rs = ri - RESPA_SWITCH * sigma;
+  const __m512d rc2 = _mm512_set1_pd(Range == RANGE_INNER ? ri * ri : rc * rc);
+  const __m512d sig2 = _mm512_set1_pd(sigma * sigma);
+  const __m512d c24 = _mm512_set1_pd(24 * epsilon / mass);
+  const __m512d one = _mm512_set1_pd(1.0);
+  const __m512d two = _mm512_set1_pd(2.0);
+  const __m512d fc = _mm512_set1_pd(fcs);
+
+  // Constants of the switching shell of a multiple time step run.
+  const __m512d rs2 = _mm512_set1_pd(rs * rs),
+    iw = _mm512_set1_pd(1 / (ri * ri - rs * rs)),
+    three = _mm512_set1_pd(3.0);
+
+  // Constants of the potential.
+  const __m512d c4 = _mm512_set1_pd(4 * epsilon),
+    uc = _mm512_set1_pd(pa.shift == SHIFT_NONE ? 0 : lenjon_u(rc * rc, pa)),
+    fcu = _mm512_set1_pd(Shifted ? lenjon_fr(rc * rc, pa) * rc : 0),
+    rcv = _mm512_set1_pd(rc);
+
+  // Potential energy and virial of all pairs.
+  __m512d uv = _mm512_setzero_pd(), virv = _mm512_setzero_pd();
+
+  // Box lengths and their inverse for the minimum image convention.
+  const __m512d lx = _mm512_set1_pd(box.right - box.left),
+    ly = _mm512_set1_pd(box.top - box.bottom),
+    lz = _mm512_set1_pd(box.back - box.front);
+  const __m512d ilx = _mm512_div_pd(one, lx), ily = _mm512_div_pd(one, ly),
+    ilz = _mm512_div_pd(one, lz);
+
+  // Component streams of the positions and accelerations.
+  const double *x = ps.mp.col(0).data(), *y = ps.mp.col(1).data(),
+    *z = ps.mp.col(2).data();
+  double *ax = ma.col(0).data(), *ay = ma.col(1).data(),
+    *az = ma.col(2).data();
+
+  for (int pi = p0; pi < p1; pi++) {
+    const __m512d xi = _mm512_set1_pd(x[pi]), yi = _mm512_set1_pd(y[pi]),
+      zi = _mm512_set1_pd(z[pi]);
+    __m512d axi = _mm512_setzero_pd(), ayi = _mm512_setzero_pd(),
+      azi = _mm512_setzero_pd();
+
+    for (int k = nl.start[pi], end = nl.start[pi + 1]; k < end; k += 8) {
+      // Lanes beyond the end of the list stay unused.
+      const __mmask8 m = end - k >= 8 ? 0xff : (1 << (end - k)) - 1;
+      const __m256i pj = _mm512_castsi512_si256(_mm512_maskz_loadu_epi32(m,
+        &nl.list[k]));
+
+      __m512d dx = _mm512_sub_pd(_mm512_mask_i32gather_pd(xi, m, pj, x, 8),
+        xi);
+      __m512d dy = _mm512_sub_pd(_mm512_mask_i32gather_pd(yi, m, pj, y, 8),
+        yi);
+      __m512d dz = _mm512_sub_pd(_mm512_mask_i32gather_pd(zi, m, pj, z, 8),
+        zi);
+
+      if (!Closed) {
+        const int mode = _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC;
+        dx = _mm512_fnmadd_pd(lx, _mm512_roundscale_pd(_mm512_mul_pd(dx, ilx),
+          mode), dx);
+        dy = _mm512_fnmadd_pd(ly, _mm512_roundscale_pd(_mm512_mul_pd(dy, ily),
+          mode), dy);
+        dz = _mm512_fnmadd_pd(lz, _mm512_roundscale_pd(_mm512_mul_pd(dz, ilz),
+          mode), dz);
+      }
+
+      __m512d r2 = _mm512_fmadd_pd(dz, dz, _mm512_fmadd_pd(dy, dy,
+        _mm512_mul_pd(dx, dx)));
+
+      // Only pairs inside the cutoff radius count. Unused lanes have a
+      // distance of zero and drop out as well.
+      const __mmask8 mc = _mm512_mask_cmp_pd_mask(m, r2, rc2, _CMP_LT_OQ) &
+        _mm512_cmp_pd_mask(r2, _mm512_setzero_pd(), _CMP_GT_OQ);
+
+      // Acceleration divided by the distance.
+      __m512d ir2 = _mm512_div_pd(one, r2);
+      __m512d s2 = _mm512_mul_pd(sig2, ir2);
+      __m512d s6 = _mm512_mul_pd(_mm512_mul_pd(s2, s2), s2);
+      __m512d f = _mm512_mul_pd(_mm512_mul_pd(c24, ir2),
+        _mm512_mul_pd(s6, _mm512_fmsub_pd(s6, two, one)));
+      if (Shifted)
+        f = _mm512_sub_pd(f, _mm512_div_pd(fc, _mm512_sqrt_pd(r2)));
+
+      // Share of the pairs in the range, see respa_weight().
+      __m512d w = one;
+      if (Range != RANGE_ALL) {
+        __m512d xs = _mm512_min_pd(_mm512_max_pd(_mm512_mul_pd(
+          _mm512_sub_pd(r2, rs2), iw), _mm512_setzero_pd()), one);
+        w = _mm512_fnmadd_pd(_mm512_mul_pd(xs, xs),
+          _mm512_fnmadd_pd(two, xs, three), one);
+        if (Range == RANGE_OUTER)
+          w = _mm512_sub_pd(one, w);
+        f = _mm512_mul_pd(f, w);
+      }
+      f = _mm512_maskz_mov_pd(mc, f);
+
+      if (Energy) {
+        __m512d up = _mm512_fmsub_pd(_mm512_mul_pd(c4, s6),
+          _mm512_sub_pd(s6, one), uc);
+        if (Shifted)
+          up = _mm512_fmadd_pd(_mm512_sub_pd(_mm512_sqrt_pd(r2), rcv), fcu,
+            up);
+        if (Range != RANGE_ALL)
+          up = _mm512_mul_pd(up, w);
+        uv = _mm512_mask_add_pd(uv, mc, uv, up);
+        virv = _mm512_fmadd_pd(f, r2, virv);
+      }
+
+      // A repulsive force pushes the main particle away from the other one.
+      __m512d fxv = _mm512_mul_pd(dx, f), fyv = _mm512_mul_pd(dy, f),
+        fzv = _mm512_mul_pd(dz, f);
+      axi = _mm512_sub_pd(axi, fxv);
+      ayi = _mm512_sub_pd(ayi, fyv);
+      azi = _mm512_sub_pd(azi, fzv);
+
+      // Cause of the third Newton's-Law every force can be used for the
+      // other particle.
+      __m512d axj = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), m, pj, ax,
+        8);
+      __m512d ayj = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), m, pj, ay,
+        8);
+      __m512d azj = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), m, pj, az,
+        8);
+      _mm512_mask_i32scatter_pd(ax, m, pj, _mm512_add_pd(axj, fxv), 8);
+      _mm512_mask_i32scatter_pd(ay, m, pj, _mm512_add_pd(ayj, fyv), 8);
+      _mm512_mask_i32scatter_pd(az, m, pj, _mm512_add_pd(azj, fzv), 8);
+    }
+
+    ax[pi] += _mm512_reduce_add_pd(axi);
+    ay[pi] += _mm512_reduce_add_pd(ayi);
+    az[pi] += _mm512_reduce_add_pd(azi);
+  }
+
+  if (Energy) {
+    sums[0] += _mm512_reduce_add_pd(uv);
+    sums[1] += _mm512_reduce_add_pd(virv);
+  }
+}
+
+/** 
+ * \brief Add the accelerations of the pairs of the neighbour list with AVX2
+ *        in mixed precision.
+ *
+ * Like accel_avx2(), but the distances and the force are calculated in
+ * single precision from the single precision copy of the positions, so
+ * eight partners are handled at once. The accelerations, the energy and the
+ * virial are summed up in double precision.
+ *
+ * \tparam Reduced True for reduced units, where sigma, epsilon and mass are
+ *                 one.
+ * \tparam Closed True if the box is closed.
+ * \tparam Shifted True if the force is shifted at the cutoff radius.
+ * \tparam Energy True if the potential energy and the virial should be
+ *                summed up as well.
+ * \tparam Range Range of the force, one of the RANGE_ values. The inner
+ *               range ends at the inner radius.
+ * \param[in] ps Reference to the particles with the single precision
+ *               positions.
+ * \param[in] nl Neighbour list that is valid for the given positions.
+ * \param[in] box Reference to the box.
+ * \param[in] p0 First main particle to handle.
+ * \param[in] p1 Main particle behind the last one to handle.
+ * \param[in] pa Parameters of the simulation.
+ * \param[in,out] ma Matrix the accelerations are added to /(m/s^2).
+ * \param[in,out] sums Potential energy /J and virial divided by the mass
+ *                     /(m^2/s^2) the pairs are added to, if Energy is set. */
+template <bool Reduced, bool Closed, bool Shifted, bool Energy, int Range>
+__attribute__((target("avx2,fma")))
+void accel_avx2_mixed(const Particles &ps, const NeighbourList &nl,
+  const Box &box, int p0, int p1, const Parameters &pa, MatrixX3d &ma,
+  double *sums) {
+  // Constants of the force, known at compile time for reduced units.
+  const double sigma = Reduced ? 1.0 : pa.sigma,
+    epsilon = Reduced ? 1.0 : pa.epsilon, mass = Reduced ? 1.0 : pa.mass;
+  const double rc = pa.rcut * sigma, fcs = Shifted ?
+    lenjon_fr(rc * rc, pa) * rc / mass : 0;
+  const double ri = pa.rinner * sigma, rs = ri - RESPA_SWITCH * sigma,
+    rcs2 = Range == RANGE_INNER ? ri * ri : rc * rc, rss2 = rs * rs,
+    iws = 1 / (ri * ri - rss2);
+
+  // Constants of the force for all lanes.
+  const __m256 rc2 = _mm256_set1_ps(rcs2);
+  const __m256 sig2 = _mm256_set1_ps(sigma * sigma);
+  const __m256 c24 = _mm256_set1_ps(24 * epsilon / mass);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 fc = _mm256_set1_ps(fcs);
+
+  // Constants of the switching shell of a multiple time step run.
+  const __m256 rs2 = _mm256_set1_ps(rss2), iw = _mm256_set1_ps(iws),
+    two = _mm256_set1_ps(2.0f), three = _mm256_set1_ps(3.0f);
+
+  // Constants of the potential.
+  const double ucs = pa.shift == SHIFT_NONE ? 0 : lenjon_u(rc * rc, pa),
+    fcus = Shifted ? lenjon_fr(rc * rc, pa) * rc : 0;
+  const __m256 c4 = _mm256_set1_ps(4 * epsilon), uc = _mm256_set1_ps(ucs),
+    fcu = _mm256_set1_ps(fcus), rcv = _mm256_set1_ps(rc);
+
+  // Potential energy and virial of all pairs, in lanes and one by one.
+  __m256d uv = _mm256_setzero_pd(), virv = _mm256_setzero_pd();
+  double u = 0, vir = 0;
+
+  // Box lengths and their inverse for the minimum image convention.
+  const __m256 lx = _mm256_set1_ps(box.right - box.left),
+    ly = _mm256_set1_ps(box.top - box.bottom),
+    lz = _mm256_set1_ps(box.back - box.front);
+  const __m256 ilx = _mm256_div_ps(one, lx), ily = _mm256_div_ps(one, ly),
+    ilz = _mm256_div_ps(one, lz);
+
+  // Component streams of the positions and accelerations.
+  const float *x = ps.mf.col(0).data(), *y = ps.mf.col(1).data(),
+    *z = ps.mf.col(2).data();
+  double *ax = ma.col(0).data(), *ay = ma.col(1).data(),
+    *az = ma.col(2).data();
+
+  alignas(32) float fx[8], fy[8], fz[8];
+  alignas(32) double sx[4], sy[4], sz[4];
+
+  for (int pi = p0; pi < p1; pi++) {
+    const __m256 xi = _mm256_set1_ps(x[pi]), yi = _mm256_set1_ps(y[pi]),
+      zi = _mm256_set1_ps(z[pi]);
+    __m256d axi = _mm256_setzero_pd(), ayi = _mm256_setzero_pd(),
+      azi = _mm256_setzero_pd();
+
+    int k = nl.start[pi], end = nl.start[pi + 1];
+    for (; k + 8 <= end; k += 8) {
+      const __m256i pj = _mm256_loadu_si256((const __m256i *) &nl.list[k]);
+
+      __m256 dx = _mm256_sub_ps(_mm256_i32gather_ps(x, pj, 4), xi);
+      __m256 dy = _mm256_sub_ps(_mm256_i32gather_ps(y, pj, 4), yi);
+      __m256 dz = _mm256_sub_ps(_mm256_i32gather_ps(z, pj, 4), zi);
+
+      if (!Closed) {
+        const int mode = _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC;
+        dx = _mm256_fnmadd_ps(lx, _mm256_round_ps(_mm256_mul_ps(dx, ilx),
+          mode), dx);
+        dy = _mm256_fnmadd_ps(ly, _mm256_round_ps(_mm256_mul_ps(dy, ily),
+          mode), dy);
+        dz = _mm256_fnmadd_ps(lz, _mm256_round_ps(_mm256_mul_ps(dz, ilz),
+          mode), dz);
+      }
+
+      __m256 r2 = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy,
+        _mm256_mul_ps(dx, dx)));
+
+      // Acceleration divided by the distance, zero outside the cutoff radius.
+      __m256 ir2 = _mm256_div_ps(one, r2);
+      __m256 s2 = _mm256_mul_ps(sig2, ir2);
+      __m256 s6 = _mm256_mul_ps(_mm256_mul_ps(s2, s2), s2);
+      __m256 f = _mm256_mul_ps(_mm256_mul_ps(c24, ir2),
+        _mm256_mul_ps(s6, _mm256_fmsub_ps(s6, two, one)));
+      if (Shifted)
+        f = _mm256_sub_ps(f, _mm256_div_ps(fc, _mm256_sqrt_ps(r2)));
+
+      // Share of the pairs in the range, see respa_weight().
+      __m256 w = one;
+      if (Range != RANGE_ALL) {
+        __m256 xs = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(
+          _mm256_sub_ps(r2, rs2), iw), _mm256_setzero_ps()), one);
+        w = _mm256_fnmadd_ps(_mm256_mul_ps(xs, xs),
+          _mm256_fnmadd_ps(two, xs, three), one);
+        if (Range == RANGE_OUTER)
+          w = _mm256_sub_ps(one, w);
+        f = _mm256_mul_ps(f, w);
+      }
+      // Coincident particles drop out, as in the other kernels.
+      const __m256 in = _mm256_and_ps(_mm256_cmp_ps(r2, rc2, _CMP_LT_OQ),
+        _mm256_cmp_ps(r2, _mm256_setzero_ps(), _CMP_GT_OQ));
+      f = _mm256_and_ps(f, in);
+
+      if (Energy) {
+        __m256 up = _mm256_fmsub_ps(_mm256_mul_ps(c4, s6),
+          _mm256_sub_ps(s6, one), uc);
+        if (Shifted)
+          up = _mm256_fmadd_ps(_mm256_sub_ps(_mm256_sqrt_ps(r2), rcv), fcu,
+            up);
+        if (Range != RANGE_ALL)
+          up = _mm256_mul_ps(up, w);
+        up = _mm256_and_ps(up, in);
+        const __m256 vp = _mm256_mul_ps(f, r2);
+        uv = _mm256_add_pd(uv, _mm256_add_pd(
+          _mm256_cvtps_pd(_mm256_castps256_ps128(up)),
+          _mm256_cvtps_pd(_mm256_extractf128_ps(up, 1))));
+        virv = _mm256_add_pd(virv, _mm256_add_pd(
+          _mm256_cvtps_pd(_mm256_castps256_ps128(vp)),
+          _mm256_cvtps_pd(_mm256_extractf128_ps(vp, 1))));
+      }
+
+      // A repulsive force pushes the main particle away from the other one.
+      __m256 fxv = _mm256_mul_ps(dx, f), fyv = _mm256_mul_ps(dy, f),
+        fzv = _mm256_mul_ps(dz, f);
+      axi = _mm256_sub_pd(_mm256_sub_pd(axi,
+        _mm256_cvtps_pd(_mm256_castps256_ps128(fxv))),
+        _mm256_cvtps_pd(_mm256_extractf128_ps(fxv, 1)));
+      ayi = _mm256_sub_pd(_mm256_sub_pd(ayi,
+        _mm256_cvtps_pd(_mm256_castps256_ps128(fyv))),
+        _mm256_cvtps_pd(_mm256_extractf128_ps(fyv, 1)));
+      azi = _mm256_sub_pd(_mm256_sub_pd(azi,
+        _mm256_cvtps_pd(_mm256_castps256_ps128(fzv))),
+        _mm256_cvtps_pd(_mm256_extractf128_ps(fzv, 1)));
+
+      // Cause of the third Newton's-Law every force can be used for the
+      // other particle.
+      _mm256_store_ps(fx, fxv);
+      _mm256_store_ps(fy, fyv);
+      _mm256_store_ps(fz, fzv);
+      for (int l = 0; l < 8; l++) {
+        int j = nl.list[k + l];
+        ax[j] += fx[l];
+        ay[j] += fy[l];
+        az[j] += fz[l];
+      }
+    }
+
+    // Sum up the lanes of the main particle.
+    _mm256_store_pd(sx, axi);
+    _mm256_store_pd(sy, ayi);
+    _mm256_store_pd(sz, azi);
+    double axs = sx[0] + sx[1] + sx[2] + sx[3],
+      ays = sy[0] + sy[1] + sy[2] + sy[3], azs = sz[0] + sz[1] + sz[2] + sz[3];
+
+    // The remaining partners are handled one by one, in double precision
+    // from the single precision distances.
+    for (; k < end; k++) {
+      int j = nl.list[k];
+      double dx = x[j] - x[pi], dy = y[j] - y[pi], dz = z[j] - z[pi];
+      if (!Closed)
+        minimum_image(dx, dy, dz, box);
+      double r2 = dx*dx + dy*dy + dz*dz;
+      if (r2 < rcs2 && r2 > 0) {
+        double w = respa_weight<Range>(r2, rss2, iws);
+        double f = lenjon_accel<Shifted>(r2, sigma * sigma,
+          24 * epsilon / mass, fcs) * w;
+        axs -= dx*f;
+        ays -= dy*f;
+        azs -= dz*f;
+        ax[j] += dx*f;
+        ay[j] += dy*f;
+        az[j] += dz*f;
+
+        if (Energy) {
+          u += lenjon_energy<Shifted>(r2, sigma * sigma, 4 * epsilon, ucs, rc,
+            fcus) * w;
+          vir += f*r2;
+        }
+      }
+    }
+
+    ax[pi] += axs;
+    ay[pi] += ays;
+    az[pi] += azs;
+  }
+
+  if (Energy) {
+    _mm256_store_pd(sx, uv);
+    _mm256_store_pd(sy, virv);
+    sums[0] += u + sx[0] + sx[1] + sx[2] + sx[3];
+    sums[1] += vir + sy[0] + sy[1] + sy[2] + sy[3];
+  }
+}
+
+/** 
+ * \brief Convert the lanes of a single precision vector to two double
+ *        precision vectors.
+ * \param[in] v Single precision vector.
+ * \param[out] lo Lower eight lanes.
+ * \param[out] hi Upper eight lanes. */
+__attribute__((target("avx512f")))
+inline void mixed_widen(__m512 v, __m512d &lo, __m512d &hi) {
+  lo = _mm512_cvtps_pd(_mm512_castps512_ps256(v));
+  hi = _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(
+    _mm512_castps_pd(v), 1)));
+}
+
+/** 
+ * \brief Add the accelerations of the pairs of the neighbour list with
+ *        AVX-512 in mixed precision.
+ *
+ * Like accel_avx512(), but the distances and the force are calculated in
+ * single precision from the single precision copy of the positions, so
+ * sixteen partners are handled at once. The accelerations of both halves of
+ * the partners are gathered, added and scattered back in double precision;
+ * the energy and the virial are summed up in double precision as well.
+ *
+ * \tparam Reduced True for reduced units, where sigma, epsilon and mass are
+ *                 one.
+ * \tparam Closed True if the box is closed.
+ * \tparam Shifted True if the force is shifted at the cutoff radius.
+ * \tparam Energy True if the potential energy and the virial should be
+ *                summed up as well.
+ * \tparam Range Range of the force, one of the RANGE_ values. The inner
+ *               range ends at the inner radius.
+ * \param[in] ps Reference to the particles with the single precision
+ *               positions.
+ * \param[in] nl Neighbour list that is valid for the given positions.
+ * \param[in] box Reference to the box.
+ * \param[in] p0 First main particle to handle.
+ * \param[in] p1 Main particle behind the last one to handle.
+ * \param[in] pa Parameters of the simulation.
+ * \param[in,out] ma Matrix the accelerations are added to /(m/s^2).
+ * \param[in,out] sums Potential energy /J and virial divided by the mass
+ *                     /(m^2/s^2) the pairs are added to, if Energy is set. */
+template <bool Reduced, bool Closed, bool Shifted, bool Energy, int Range>
+__attribute__((target("avx512f")))
+void accel_avx512_mixed(const Particles &ps, const NeighbourList &nl,
+  const Box &box, int p0, int p1, const Parameters &pa, MatrixX3d &ma,
+  double *sums) {
+  // Constants of the force, known at compile time for reduced units.
+  const double sigma = Reduced ? 1.0 : pa.sigma,
+    epsilon = Reduced ? 1.0 : pa.epsilon, mass = Reduced ? 1.0 : pa.mass;
+  const double rc = pa.rcut * sigma, fcs = Shifted ?
+    lenjon_fr(rc * rc, pa) * rc / mass : 0;
+
+  // Constants of the force for all lanes.
+  const double ri = pa.rinner * sigma, rs = ri - RESPA_SWITCH * sigma;
+  const __m512 rc2 = _mm512_set1_ps(Range == RANGE_INNER ? ri * ri : rc * rc);
+  const __m512 sig2 = _mm512_set1_ps(sigma * sigma);
+  const __m512 c24 = _mm512_set1_ps(24 * epsilon / mass);
+  const __m512 one = _mm512_set1_ps(1.0f);
+  const __m512 two = _mm512_set1_ps(2.0f);
+  const __m512 fc = _mm512_set1_ps(fcs);
+
+  // Constants of the switching shell of a multiple time step run.
+  const __m512 rs2 = _mm512_set1_ps(rs * rs),
+    iw = _mm512_set1_ps(1 / (ri * ri - rs * rs)),
+    three = _mm512_set1_ps(3.0f);
+
+  // Constants of the potential.
+  const __m512 c4 = _mm512_set1_ps(4 * epsilon),
+    uc = _mm512_set1_ps(pa.shift == SHIFT_NONE ? 0 : lenjon_u(rc * rc, pa)),
+    fcu = _mm512_set1_ps(Shifted ? lenjon_fr(rc * rc, pa) * rc : 0),
+    rcv = _mm512_set1_ps(rc);
+
+  // Potential energy and virial of all pairs.
+  __m512d uv = _mm512_setzero_pd(), virv = _mm512_setzero_pd();
+
+  // Box lengths and their inverse for the minimum image convention.
+  const __m512 lx = _mm512_set1_ps(box.right - box.left),
+    ly = _mm512_set1_ps(box.top - box.bottom),
+    lz = _mm512_set1_ps(box.back - box.front);
+  const __m512 ilx = _mm512_div_ps(one, lx), ily = _mm512_div_ps(one, ly),
+    ilz = _mm512_div_ps(one, lz);
+
+  // Component streams of the positions and accelerations.
+  const float *x = ps.mf.col(0).data(), *y = ps.mf.col(1).data(),
+    *z = ps.mf.col(2).data();
+  double *ax = ma.col(0).data(), *ay = ma.col(1).data(),
+    *az = ma.col(2).data();
+
+  for (int pi = p0; pi < p1; pi++) {
+    const __m512 xi = _mm512_set1_ps(x[pi]), yi = _mm512_set1_ps(y[pi]),
+      zi = _mm512_set1_ps(z[pi]);
+    __m512d axi = _mm512_setzero_pd(), ayi = _mm512_setzero_pd(),
+      azi = _mm512_setzero_pd();
+
+    for (int k = nl.start[pi], end = nl.start[pi + 1]; k < end; k += 16) {
+      // Lanes beyond the end of the list stay unused.
+      const __mmask16 m = end - k >= 16 ? 0xffff : (1 << (end - k)) - 1;
+      const __m512i pj = _mm512_maskz_loadu_epi32(m, &nl.list[k]);
+
+      __m512 dx = _mm512_sub_ps(_mm512_mask_i32gather_ps(xi, m, pj, x, 4),
+        xi);
+      __m512 dy = _mm512_sub_ps(_mm512_mask_i32gather_ps(yi, m, pj, y, 4),
+        yi);
+      __m512 dz = _mm512_sub_ps(_mm512_mask_i32gather_ps(zi, m, pj, z, 4),
+        zi);
+
+      if (!Closed) {
+        const int mode = _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC;
+        dx = _mm512_fnmadd_ps(lx, _mm512_roundscale_ps(_mm512_mul_ps(dx, ilx),
+          mode), dx);
+        dy = _mm512_fnmadd_ps(ly, _mm512_roundscale_ps(_mm512_mul_ps(dy, ily),
+          mode), dy);
+        dz = _mm512_fnmadd_ps(lz, _mm512_roundscale_ps(_mm512_mul_ps(dz, ilz),
+          mode), dz);
+      }
+
+      __m512 r2 = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy,
+        _mm512_mul_ps(dx, dx)));
+
+      // Only pairs inside the cutoff radius count. Unused lanes have a
+      // distance of zero and drop out as well.
+      const __mmask16 mc = _mm512_mask_cmp_ps_mask(m, r2, rc2, _CMP_LT_OQ) &
+        _mm512_cmp_ps_mask(r2, _mm512_setzero_ps(), _CMP_GT_OQ);
+
+      // Acceleration divided by the distance.
+      __m512 ir2 = _mm512_div_ps(one, r2);
+      __m512 s2 = _mm512_mul_ps(sig2, ir2);
+      __m512 s6 = _mm512_mul_ps(_mm512_mul_ps(s2, s2), s2);
+      __m512 f = _mm512_mul_ps(_mm512_mul_ps(c24, ir2),
+        _mm512_mul_ps(s6, _mm512_fmsub_ps(s6, two, one)));
+      if (Shifted)
+        f = _mm512_sub_ps(f, _mm512_div_ps(fc, _mm512_sqrt_ps(r2)));
+
+      // Share of the pairs in the range, see respa_weight().
+      __m512 w = one;
+      if (Range != RANGE_ALL) {
+        __m512 xs = _mm512_min_ps(_mm512_max_ps(_mm512_mul_ps(
+          _mm512_sub_ps(r2, rs2), iw), _mm512_setzero_ps()), one);
+        w = _mm512_fnmadd_ps(_mm512_mul_ps(xs, xs),
+          _mm512_fnmadd_ps(two, xs, three), one);
+        if (Range == RANGE_OUTER)
+          w = _mm512_sub_ps(one, w);
+        f = _mm512_mul_ps(f, w);
+      }
+      f = _mm512_maskz_mov_ps(mc, f);
+
+      if (Energy) {
+        __m512 up = _mm512_fmsub_ps(_mm512_mul_ps(c4, s6),
+          _mm512_sub_ps(s6, one), uc);
+        if (Shifted)
+          up = _mm512_fmadd_ps(_mm512_sub_ps(_mm512_sqrt_ps(r2), rcv), fcu,
+            up);
+        if (Range != RANGE_ALL)
+          up = _mm512_mul_ps(up, w);
+        __m512d lo, hi;
+        mixed_widen(_mm512_maskz_mov_ps(mc, up), lo, hi);
+        uv = _mm512_add_pd(uv, _mm512_add_pd(lo, hi));
+        mixed_widen(_mm512_mul_ps(f, r2), lo, hi);
+        virv = _mm512_add_pd(virv, _mm512_add_pd(lo, hi));
+      }
+
+      // A repulsive force pushes the main particle away from the other one.
+      // Cause of the third Newton's-Law every force can be used for the
+      // other particle. The accelerations of both halves of the partners are
+      // gathered before the first scatter, which would stall the following
+      // gathers.
+      const __m256i pjl = _mm512_castsi512_si256(pj),
+        pjh = _mm512_extracti64x4_epi64(pj, 1);
+      const __mmask8 ml = m & 0xff, mh = m >> 8;
+      const __m512d zero = _mm512_setzero_pd();
+      __m512d fxl, fxh, fyl, fyh, fzl, fzh;
+      mixed_widen(_mm512_mul_ps(dx, f), fxl, fxh);
+      mixed_widen(_mm512_mul_ps(dy, f), fyl, fyh);
+      mixed_widen(_mm512_mul_ps(dz, f), fzl, fzh);
+      axi = _mm512_sub_pd(_mm512_sub_pd(axi, fxl), fxh);
+      ayi = _mm512_sub_pd(_mm512_sub_pd(ayi, fyl), fyh);
+      azi = _mm512_sub_pd(_mm512_sub_pd(azi, fzl), fzh);
+
+      __m512d axl = _mm512_mask_i32gather_pd(zero, ml, pjl, ax, 8),
+        axh = _mm512_mask_i32gather_pd(zero, mh, pjh, ax, 8),
+        ayl = _mm512_mask_i32gather_pd(zero, ml, pjl, ay, 8),
+        ayh = _mm512_mask_i32gather_pd(zero, mh, pjh, ay, 8),
+        azl = _mm512_mask_i32gather_pd(zero, ml, pjl, az, 8),
+        azh = _mm512_mask_i32gather_pd(zero, mh, pjh, az, 8);
+      _mm512_mask_i32scatter_pd(ax, ml, pjl, _mm512_add_pd(axl, fxl), 8);
+      _mm512_mask_i32scatter_pd(ax, mh, pjh, _mm512_add_pd(axh, fxh), 8);
+      _mm512_mask_i32scatter_pd(ay, ml, pjl, _mm512_add_pd(ayl, fyl), 8);
+      _mm512_mask_i32scatter_pd(ay, mh, pjh, _mm512_add_pd(ayh, fyh), 8);
+      _mm512_mask_i32scatter_pd(az, ml, pjl, _mm512_add_pd(azl, fzl), 8);
+      _mm512_mask_i32scatter_pd(az, mh, pjh, _mm512_add_pd(azh, fzh), 8);
+    }
+
+    ax[pi] += _mm512_reduce_add_pd(axi);
+    ay[pi] += _mm512_reduce_add_pd(ayi);
+    az[pi] += _mm512_reduce_add_pd(azi);
+  }
+
+  if (Energy) {
+    sums[0] += _mm512_reduce_add_pd(uv);
+    sums[1] += _mm512_reduce_add_pd(virv);
+  }
+}
+#endif
+
+// Function of a force kernel adding up the accelerations of the pairs.
+typedef void (*KernelAccel)(const Particles &, const NeighbourList &,
+  const Box &, int, int, const Parameters &, MatrixX3d &, double *);
+
+// All variants of a force kernel for one range of the force, indexed by
+// 8 * energy + 4 * reduced units + 2 * closed box + shifted force.
+#define KERNEL_VARIANTS(k, r) { \
+  k<false, false, false, false, r>, k<false, false, true, false, r>, \
+  k<false, true, false, false, r>, k<false, true, true, false, r>, \
+  k<true, false, false, false, r>, k<true, false, true, false, r>, \
+  k<true, true, false, false, r>, k<true, true, true, false, r>, \
+  k<false, false, false, true, r>, k<false, false, true, true, r>, \
+  k<false, true, false, true, r>, k<false, true, true, true, r>, \
+  k<true, false, false, true, r>, k<true, false, true, true, r>, \
+  k<true, true, false, true, r>, k<true, true, true, true, r>}
+
+// The variants of a force kernel for all ranges of the force.
+#define KERNEL_RANGES(k) { \
+  KERNEL_VARIANTS(k, RANGE_ALL), KERNEL_VARIANTS(k, RANGE_INNER), \
+  KERNEL_VARIANTS(k, RANGE_OUTER)}
+
+/**
+ * \brief Force kernel that fits the features of the CPU and the parameters
+ *        best. */
+struct Kernel {
+  // Name of the kernel for the user.
+  const char *name;
+
+  // True if the kernel runs in reduced units.
+  bool reduced;
+
+  // True if the kernel calculates the pairs in single precision.
+  bool mixed;
+
+  // Functions adding up the accelerations of the pairs of every range of
+  // the force, without and with the potential energy and the virial; 0 if
+  // the kernel is not supported by the CPU.
+  KernelAccel accel[RANGES], energy[RANGES];
+};
+
+// Names of all force kernels, the best one first.
+#define KERNELS 3
+const char * const kernel_names[KERNELS] = {"avx512", "avx2", "generic"};
+
+/** 
+ * \brief Find a force kernel by its name.
+ *
+ * Every kernel is compiled for reduced units, closed or periodic boxes,
+ * shifted or unshifted forces, with or without energy and for every range
+ * of the force, so the constants and branches of the common cases are
+ * resolved at compile time. The variants matching the parameters are
+ * returned. The vector kernels come in mixed precision as well.
+ *
+ * \param[in] name Name of the kernel.
+ * \param[in] pa Parameters of the simulation.
+ * \param[in] box Reference to the box.
+ * \return The kernel; without function if the CPU does not support it. */
+Kernel kernel_find(const std::string &name, const Parameters &pa,
+  const Box &box) {
+  static const KernelAccel generic[RANGES][16] =
+    KERNEL_RANGES(accel_generic);
+
+  bool reduced = pa.sigma == 1 && pa.epsilon == 1 && pa.mass == 1;
+  int vi = 4 * reduced + 2 * box.closed + (pa.shift == SHIFT_FORCE);
+
+  Kernel kernel = {0, reduced, pa.mixed != 0, {0, 0, 0}, {0, 0, 0}};
+  const KernelAccel (*variants)[16] = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+  static const KernelAccel avx2[RANGES][16] = KERNEL_RANGES(accel_avx2);
+  static const KernelAccel avx512[RANGES][16] = KERNEL_RANGES(accel_avx512);
+  static const KernelAccel avx2_mixed[RANGES][16] =
+    KERNEL_RANGES(accel_avx2_mixed);
+  static const KernelAccel avx512_mixed[RANGES][16] =
+    KERNEL_RANGES(accel_avx512_mixed);
+
+  __builtin_cpu_init();
+  if (name == "avx512" && __builtin_cpu_supports("avx512f")) {
+    kernel.name = "avx512";
+    variants = pa.mixed ? avx512_mixed : avx512;
+  }
+  if (name == "avx2" && __builtin_cpu_supports("avx2") &&
+      __builtin_cpu_supports("fma")) {
+    kernel.name = "avx2";
+    variants = pa.mixed ? avx2_mixed : avx2;
+  }
+#endif
+  // The generic kernel is not made for single precision, which would not
+  // be faster without vectors.
+  if (name == "generic" && !pa.mixed) {
+    kernel.name = "generic";
+    variants = generic;
+  }
+
+  for (int r = 0; variants && r < RANGES; r++) {
+    kernel.accel[r] = variants[r][vi];
+    kernel.energy[r] = variants[r][vi + 8];
+  }
+  return kernel;
+}
+
+/** 
+ * \brief Select the force kernel given by the parameters, or else the best
+ *        one supported by the running CPU.
+ *
+ * The kernel is selected once per simulation, so its variant can not change
+ * inside the time step loop.
+ *
+ * \param[in] pa Parameters of the simulation.
+ * \param[in] box Reference to the box.
+ * \return The selected kernel. */
+Kernel kernel_select(const Parameters &pa, const Box &box) {
+  if (pa.kernel != "auto") {
+    Kernel kernel = kernel_find(pa.kernel, pa, box);
+    if (kernel.accel[RANGE_ALL])
+      return kernel;
+    std::cout << "Error: Force kernel not supported by the CPU"
+	      << (pa.mixed ? " in mixed precision: " : ": ") << pa.kernel
+	      << std::endl;
+  }
+
+  // The generic kernel runs everywhere, in double precision only.
+  for (int ki = 0; ki < KERNELS - 1; ki++) {
+    Kernel kernel = kernel_find(kernel_names[ki], pa, box);
+    if (kernel.accel[RANGE_ALL])
+      return kernel;
+  }
+
+  Parameters dp = pa;
+  if (dp.mixed) {
+    std::cout << "Error: No mixed precision force kernel for the CPU."
+	      << std::endl;
+    dp.mixed = 0;
+  }
+  return kernel_find("generic", dp, box);
+}
+
+/** 
+ * \brief Set up the grid of ranks and the sub-box of this rank.
+ *
+ * The ranks are spread as evenly as possible over the dimensions and the box
+ * is split into sub-boxes of equal size, unless the borders of a checkpoint
+ * fit the grid of ranks. Every sub-box has to be at least as wide as the
+ * halo, so the ghosts come from the neighbour ranks only. A periodic box has
+ * to be at least twice as wide as the halo along a dimension with a single
+ * rank, so the images of the own particles are unique.
+ *
+ * \param[out] dm Reference to the domain.
+ * \param[in] box Reference to the box of the whole system.
+ * \param[in] pa Parameters of the simulation.
+ * \param[in] cuts Borders of the sub-boxes per dimension from a checkpoint;
+ *                 empty for equal sub-boxes.
+ * \return True if the box can be split over the ranks, else false. */
+bool domain_init(Domain &dm, const Box &box, const Parameters &pa,
+  const std::vector<double> *cuts) {
+  dm.rank = 0;
+  dm.size = 1;
+  dm.pending = false;
+  dm.waited = 0;
+
+#ifdef USE_MPI
+  MPI_Comm_rank(MPI_COMM_WORLD, &dm.rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &dm.size);
+  if (dm.size == 1)
+    return true;
+
+  // The ranks keep their numbers, so the first one still writes the files.
+  int periods[3];
+  for (int d = 0; d < 3; d++) {
+    dm.dims[d] = 0;
+    periods[d] = !box.closed;
+  }
+  MPI_Dims_create(dm.size, 3, dm.dims);
+  MPI_Cart_create(MPI_COMM_WORLD, 3, dm.dims, periods, 0, &dm.comm);
+  MPI_Cart_coords(dm.comm, dm.rank, 3, dm.coords);
+
+  dm.box = box;
+  dm.halo = (pa.rcut + pa.skin) * pa.sigma;
+
+  const double lo[3] = {box.left, box.bottom, box.front};
+  const double hi[3] = {box.right, box.top, box.back};
+  bool fits = true;
+  bool saved = true;
+  for (int d = 0; d < 3; d++)
+    saved = saved && (int) cuts[d].size() == dm.dims[d] + 1;
+
+  for (int d = 0; d < 3; d++) {
+    MPI_Cart_shift(dm.comm, d, 1, &dm.lower[d], &dm.upper[d]);
+
+    dm.cuts[d].resize(dm.dims[d] + 1);
+    for (int c = 0; c <= dm.dims[d]; c++)
+      dm.cuts[d][c] = saved ? cuts[d][c] :
+        lo[d] + (hi[d] - lo[d]) * c / dm.dims[d];
+
+    for (int c = 0; c < dm.dims[d]; c++)
+      if (dm.cuts[d][c + 1] - dm.cuts[d][c] < dm.halo)
+        fits = false;
+  }
+
+  if (!fits) {
+    std::cout << "Error: Sub-boxes of " << dm.size << " ranks smaller than "
+	      << "cutoff radius plus skin." << std::endl;
+    return false;
+  }
+
+  // Along a periodic dimension with a single rank the ghosts are images of
+  // the own particles. Every image has to be unique, else pairs are counted
+  // twice.
+  for (int d = 0; d < 3; d++)
+    if (!box.closed && dm.dims[d] == 1 && hi[d] - lo[d] < 2 * dm.halo) {
+      std::cout << "Error: Periodic box of " << dm.size << " ranks shorter "
+		<< "than twice the cutoff radius plus skin along a dimension "
+		<< "with a single rank." << std::endl;
+      return false;
+    }
+#else
+  (void) box;
+  (void) pa;
+  (void) cuts;
+#endif
+
+  return true;
+}
+
+/** 
+ * \brief Release the communicator of the grid of ranks.
+ * \param[in,out] dm Reference to the domain. */
+void domain_close(Domain &dm) {
+#ifdef USE_MPI
+  if (dm.size > 1)
+    MPI_Comm_free(&dm.comm);
+#else
+  (void) dm;
+#endif
+}
+
+/** 
+ * \brief Divide the box into cells for building the neighbour list.
+ *
+ * With several ranks only the own sub-box with its halo is divided. It is
+ * treated as a closed box, because the ghosts are images of their owners
+ * already.
+ *
+ * \param[in] dm Reference to the domain.
+ * \param[out] cl Reference to the cell list.
+ * \param[in] box Reference to the box of the whole system.
+ * \param[in] pa Parameters of the simulation. */
+void domain_cells(const Domain &dm, CellList &cl, const Box &box,
+  const Parameters &pa) {
+  double rl = (pa.rcut + pa.skin) * pa.sigma;
+
+#ifdef USE_MPI
+  if (dm.size > 1) {
+    const int *c = dm.coords;
+    Box sub = {dm.cuts[0][c[0]] - dm.halo, dm.cuts[0][c[0] + 1] + dm.halo,
+      dm.cuts[1][c[1] + 1] + dm.halo, dm.cuts[1][c[1]] - dm.halo,
+      dm.cuts[2][c[2]] - dm.halo, dm.cuts[2][c[2] + 1] + dm.halo, true};
+    cells_init(cl, sub, rl);
+    return;
+  }
+#else
+  (void) dm;
+#endif
+
+  cells_init(cl, box, rl);
+}
+
+/** 
+ * \brief Test whether any rank has a true flag.
+ * \param[in] dm Reference to the domain.
+ * \param[in] flag Flag of this rank.
+ * \return True if the flag of any rank is true, else false. */
+bool domain_any(const Domain &dm, bool flag) {
+#ifdef USE_MPI
+  if (dm.size > 1) {
+    int any = flag;
+    MPI_Allreduce(MPI_IN_PLACE, &any, 1, MPI_INT, MPI_LOR, dm.comm);
+    return any;
+  }
+#else
+  (void) dm;
+#endif
+  return flag;
+}
+
+/** 
+ * \brief Sum up values over all ranks.
+ * \param[in] dm Reference to the domain.
+ * \param[in,out] values Values of this rank, replaced by the sums.
+ * \param[in] count Number of values. */
+void domain_sum(const Domain &dm, double *values, int count) {
+#ifdef USE_MPI
+  if (dm.size > 1)
+    MPI_Allreduce(MPI_IN_PLACE, values, count, MPI_DOUBLE, MPI_SUM, dm.comm);
+#else
+  (void) dm;
+  (void) values;
+  (void) count;
+#endif
+}
+
+#ifdef USE_MPI
+/** 
+ * \brief Find the coordinate of the rank owning a position in one dimension.
+ *
+ * Positions outside a closed box belong to the ranks at its border.
+ *
+ * \param[in] dm Reference to the domain.
+ * \param[in] d Dimension.
+ * \param[in] x Coordinate of the position /m.
+ * \return Coordinate of the owning rank in the grid. */
+inline int domain_coord(const Domain &dm, int d, double x) {
+  const std::vector<double> &cuts = dm.cuts[d];
+  int n = dm.dims[d];
+
+  if (!dm.box.closed) {
+    double l = cuts[n] - cuts[0];
+    x -= l * std::floor((x - cuts[0]) / l);
+  }
+
+  return std::upper_bound(cuts.begin() + 1, cuts.end() - 1, x) -
+    cuts.begin() - 1;
+}
+
+/** 
+ * \brief Send a number of values to one neighbour rank and receive the
+ *        number of values coming from another one.
+ *
+ * The receive buffer is enlarged for the values, if needed.
+ *
+ * \param[in,out] dm Reference to the domain.
+ * \param[in] sn Number of values to send.
+ * \param[in] dest Rank to send to.
+ * \param[in] source Rank to receive from.
+ * \return Number of values to receive. */
+int domain_count(Domain &dm, int sn, int dest, int source) {
+  int rn = 0;
+  MPI_Sendrecv(&sn, 1, MPI_INT, dest, 0, &rn, 1, MPI_INT, source, 0, dm.comm,
+    MPI_STATUS_IGNORE);
+  if ((int) dm.rbuf.size() < rn)
+    dm.rbuf.resize(rn);
+  return rn;
+}
+
+/** 
+ * \brief Send the values of the send buffer to one neighbour rank and
+ *        receive the values from another one into the receive buffer.
+ * \param[in,out] dm Reference to the domain.
+ * \param[in] sn Number of values to send.
+ * \param[in] dest Rank to send to.
+ * \param[in] rn Number of values to receive.
+ * \param[in] source Rank to receive from. */
+inline void domain_sendrecv(Domain &dm, int sn, int dest, int rn,
+  int source) {
+  MPI_Sendrecv(dm.sbuf.data(), sn, MPI_DOUBLE, dest, 1, dm.rbuf.data(), rn,
+    MPI_DOUBLE, source, 1, dm.comm, MPI_STATUS_IGNORE);
+}
+#endif
+
+/** 
+ * \brief Keep the particles of the own sub-box from the whole system.
+ *
+ * Every rank starts with all particles, set up or read from a checkpoint
+ * the same way, and drops the ones of the other ranks. After a restart the
+ * positions of the last build of the neighbour list decide, as the
+ * particles were moved to their owners just before it. So every rank gets
+ * its particles back in the same rows as before.
+ *
+ * \param[in] dm Reference to the domain.
+ * \param[in,out] st Reference to the state of the simulation.
+ * \param[in] restart True if the state comes from a checkpoint, else
+ *                    false. */
+void domain_distribute(const Domain &dm, State &st, bool restart) {
+#ifdef USE_MPI
+  if (dm.size == 1)
+    return;
+
+  Particles &ps = st.ps;
+  const MatrixX3d &mp = restart ? st.nl.mp0 : ps.mp;
+  MatrixX3d *fields[5] = {&ps.mp, &ps.mv, &ps.ma, &ps.mo, &st.nl.mp0};
+  int fc = restart ? 5 : 4;
+
+  int n = 0;
+  for (int pi = 0; pi < ps.n; pi++) {
+    if (domain_coord(dm, 0, mp(pi, 0)) != dm.coords[0] ||
+        domain_coord(dm, 1, mp(pi, 1)) != dm.coords[1] ||
+        domain_coord(dm, 2, mp(pi, 2)) != dm.coords[2])
+      continue;
+
+    for (int f = 0; f < fc; f++)
+      fields[f]->row(n) = fields[f]->row(pi);
+    ps.id[n++] = ps.id[pi];
+  }
+
+  // Only the storage for the own particles is kept.
+  int rows = (n + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+  for (int f = 0; f < fc; f++) {
+    fields[f]->conservativeResize(rows, 3);
+    fields[f]->bottomRows(rows - n).setZero();
+  }
+  ps.mf.setZero(rows, 3);
+  ps.n = n;
+  ps.id.resize(n);
+
+  // The list lengths of the checkpoint are counted once over all ranks.
+  if (dm.rank != 0)
+    st.nl.length = 0;
+#else
+  (void) dm;
+  (void) st;
+  (void) restart;
+#endif
+}
+
+/** 
+ * \brief Move the particles that left the own sub-box to their new owner.
+ *
+ * The particles are sent dimension by dimension to the neighbour rank on the
+ * side they left, so those leaving over an edge or a corner reach the right
+ * rank as well. A particle moves less than a sub-box between two builds of
+ * the neighbour list, so one neighbour per dimension is enough. The ghosts
+ * are dropped and have to be chosen again.
+ *
+ * \param[in,out] dm Reference to the domain.
+ * \param[in,out] ps Reference to the particles. */
+void domain_migrate(Domain &dm, Particles &ps) {
+#ifdef USE_MPI
+  if (dm.size == 1)
+    return;
+
+  MatrixX3d *fields[4] = {&ps.mp, &ps.mv, &ps.ma, &ps.mo};
+
+  ps.mp.middleRows(ps.n, ps.ghosts).setZero();
+  ps.ghosts = 0;
+  ps.id.resize(ps.n);
+
+  // Positions, velocities, accelerations, outer accelerations and ID of every
+  // moving particle.
+  const int values = 13;
+
+  const Box &box = dm.box;
+  const double lo[3] = {box.left, box.bottom, box.front};
+  const double hi[3] = {box.right, box.top, box.back};
+
+  for (int d = 0; d < 3; d++) {
+    // The particles may have left a periodic box since the last call of
+    // boundary(). They are wrapped first, so they lie in the sub-box of their
+    // new owner and its ghosts get the right images.
+    if (!box.closed) {
+      double l = hi[d] - lo[d];
+      for (int pi = 0; pi < ps.n; pi++)
+        ps.mp(pi, d) -= l * std::floor((ps.mp(pi, d) - lo[d]) / l);
+    }
+
+    int n = dm.dims[d], below = (dm.coords[d] + n - 1) % n;
+    if (n == 1)
+      continue;
+
+    for (int dir = 0; dir < 2; dir++) {
+      // Pack the leaving particles and close the gaps behind them.
+      dm.sbuf.clear();
+      int kept = 0;
+      for (int pi = 0; pi < ps.n; pi++) {
+        int c = domain_coord(dm, d, ps.mp(pi, d));
+        bool down = box.closed ? c < dm.coords[d] : c == below;
+        if (c != dm.coords[d] && down == (dir == 0)) {
+          for (int f = 0; f < 4; f++)
+            for (int k = 0; k < 3; k++)
+              dm.sbuf.push_back((*fields[f])(pi, k));
+          dm.sbuf.push_back(ps.id[pi]);
+          continue;
+        }
+
+        if (kept != pi) {
+          for (int f = 0; f < 4; f++)
+            fields[f]->row(kept) = fields[f]->row(pi);
+          ps.id[kept] = ps.id[pi];
+        }
+        kept++;
+      }
+      for (int f = 0; f < 4; f++)
+        fields[f]->middleRows(kept, ps.n - kept).setZero();
+      ps.n = kept;
+      ps.id.resize(kept);
+
+      int dest = dir == 0 ? dm.lower[d] : dm.upper[d];
+      int source = dir == 0 ? dm.upper[d] : dm.lower[d];
+      int rn = domain_count(dm, dm.sbuf.size(), dest, source);
+      domain_sendrecv(dm, dm.sbuf.size(), dest, rn, source);
+
+      // Append the arriving particles.
+      int rc = rn / values;
+      particles_reserve(ps, ps.n + rc);
+      for (int ri = 0; ri < rc; ri++) {
+        const double *v = &dm.rbuf[ri * values];
+        for (int f = 0; f < 4; f++)
+          for (int k = 0; k < 3; k++)
+            (*fields[f])(ps.n + ri, k) = v[3 * f + k];
+        ps.id.push_back((int) v[12]);
+      }
+      ps.n += rc;
+    }
+  }
+#else
+  (void) dm;
+  (void) ps;
+#endif
+}
+
+/** 
+ * \brief Choose the ghosts of the own sub-box.
+ *
+ * In every dimension the particles and the ghosts received so far inside the
+ * halo width from the lower and upper border of the sub-box are sent to the
+ * neighbour on that side. The received ones are appended as ghosts, together
+ * with the rank and row of their owner and the shift of their position. In
+ * the end every owner learns which of its rows go to which rank between the
+ * builds. That takes a collective over all ranks, but only at the builds.
+ *
+ * \param[in,out] dm Reference to the domain.
+ * \param[in,out] ps Reference to the particles; the ghosts are replaced. */
+void domain_borders(Domain &dm, Particles &ps) {
+#ifdef USE_MPI
+  if (dm.size == 1)
+    return;
+
+  const Box &box = dm.box;
+  const double lo[3] = {box.left, box.bottom, box.front};
+  const double hi[3] = {box.right, box.top, box.back};
+
+  ps.ghosts = 0;
+  ps.id.resize(ps.n);
+
+  // Position, ID, owner rank, owner row and shift of every ghost.
+  const int values = 9;
+
+  // Owner rank and row of every ghost.
+  std::vector<int> owners, rows;
+  dm.shifts.clear();
+
+  for (int d = 0; d < 3; d++) {
+    // Ghosts received in this dimension are not sent on in it.
+    int count = ps.n + ps.ghosts;
+    double bl = dm.cuts[d][dm.coords[d]] + dm.halo;
+    double bh = dm.cuts[d][dm.coords[d] + 1] - dm.halo;
+
+    for (int dir = 0; dir < 2; dir++) {
+      int dest = dir == 0 ? dm.lower[d] : dm.upper[d];
+      int source = dir == 0 ? dm.upper[d] : dm.lower[d];
+
+      // Crossing the border of a periodic box gives the image on the other
+      // side.
+      double shift = 0;
+      if (!box.closed && dir == 0 && dm.coords[d] == 0)
+        shift = hi[d] - lo[d];
+      if (!box.closed && dir == 1 && dm.coords[d] == dm.dims[d] - 1)
+        shift = lo[d] - hi[d];
+
+      dm.sbuf.clear();
+      if (dest != MPI_PROC_NULL)
+        for (int pi = 0; pi < count; pi++) {
+          double x = ps.mp(pi, d);
+          if (dir == 0 ? x < bl : x >= bh) {
+            bool own = pi < ps.n;
+            int g = pi - ps.n;
+            for (int k = 0; k < 3; k++)
+              dm.sbuf.push_back(ps.mp(pi, k) + (k == d ? shift : 0));
+            dm.sbuf.push_back(ps.id[pi]);
+            dm.sbuf.push_back(own ? dm.rank : owners[g]);
+            dm.sbuf.push_back(own ? pi : rows[g]);
+            for (int k = 0; k < 3; k++)
+              dm.sbuf.push_back((own ? 0 : dm.shifts[3 * g + k]) +
+                (k == d ? shift : 0));
+          }
+        }
+
+      int rn = domain_count(dm, dm.sbuf.size(), dest, source);
+      domain_sendrecv(dm, dm.sbuf.size(), dest, rn, source);
+
+      int first = ps.n + ps.ghosts, rc = rn / values;
+      particles_reserve(ps, first + rc);
+      for (int ri = 0; ri < rc; ri++) {
+        const double *v = &dm.rbuf[ri * values];
+        for (int k = 0; k < 3; k++)
+          ps.mp(first + ri, k) = v[k];
+        ps.id.push_back((int) v[3]);
+        owners.push_back((int) v[4]);
+        rows.push_back((int) v[5]);
+        for (int k = 0; k < 3; k++)
+          dm.shifts.push_back(v[6 + k]);
+      }
+      ps.ghosts += rc;
+    }
+  }
+
+  // Group the ghosts by their owners, keeping their order.
+  std::vector<int> counts(dm.size, 0), displs(dm.size, 0);
+  for (int g = 0; g < ps.ghosts; g++)
+    counts[owners[g]]++;
+  for (int r = 1; r < dm.size; r++)
+    displs[r] = displs[r - 1] + counts[r - 1];
+
+  dm.recvs.resize(ps.ghosts);
+  std::vector<int> fill = displs, wanted(ps.ghosts);
+  for (int g = 0; g < ps.ghosts; g++) {
+    int k = fill[owners[g]]++;
+    dm.recvs[k] = g;
+    wanted[k] = rows[g];
+  }
+
+  dm.rpeers.clear();
+  dm.rstart.assign(1, 0);
+  for (int r = 0; r < dm.size; r++)
+    if (counts[r] > 0) {
+      dm.rpeers.push_back(r);
+      dm.rstart.push_back(displs[r] + counts[r]);
+    }
+
+  // Tell every owner the rows its ghosts here come from.
+  std::vector<int> scounts(dm.size), sdispls(dm.size, 0);
+  MPI_Alltoall(counts.data(), 1, MPI_INT, scounts.data(), 1, MPI_INT,
+    dm.comm);
+  for (int r = 1; r < dm.size; r++)
+    sdispls[r] = sdispls[r - 1] + scounts[r - 1];
+
+  dm.sends.resize(sdispls[dm.size - 1] + scounts[dm.size - 1]);
+  MPI_Alltoallv(wanted.data(), counts.data(), displs.data(), MPI_INT,
+    dm.sends.data(), scounts.data(), sdispls.data(), MPI_INT, dm.comm);
+
+  dm.speers.clear();
+  dm.sstart.assign(1, 0);
+  for (int r = 0; r < dm.size; r++)
+    if (scounts[r] > 0) {
+      dm.speers.push_back(r);
+      dm.sstart.push_back(sdispls[r] + scounts[r]);
+    }
+
+  // The exchanges between the builds must not allocate.
+  size_t most = 3 * std::max(dm.sends.size(), dm.recvs.size());
+  dm.sbuf.resize(std::max(dm.sbuf.size(), most));
+  dm.rbuf.resize(std::max(dm.rbuf.size(), most));
+  dm.requests.resize(dm.speers.size() + dm.rpeers.size());
+#else
+  (void) dm;
+  (void) ps;
+#endif
+}
+
+/** 
+ * \brief Start sending the current positions of the particles to their
+ *        ghosts.
+ *
+ * The messages to and from all ranks are posted at once without waiting
+ * for them, see domain_wait().
+ *
+ * \param[in,out] dm Reference to the domain.
+ * \param[in] ps Reference to the particles. */
+void domain_post(Domain &dm, const Particles &ps) {
+#ifdef USE_MPI
+  if (dm.size == 1)
+    return;
+
+  int rq = 0;
+  for (size_t p = 0; p < dm.rpeers.size(); p++)
+    MPI_Irecv(&dm.rbuf[3 * dm.rstart[p]],
+      3 * (dm.rstart[p + 1] - dm.rstart[p]), MPI_DOUBLE, dm.rpeers[p], 2,
+      dm.comm, &dm.requests[rq++]);
+
+  for (size_t p = 0; p < dm.speers.size(); p++) {
+    for (int k = dm.sstart[p]; k < dm.sstart[p + 1]; k++)
+      for (int c = 0; c < 3; c++)
+        dm.sbuf[3 * k + c] = ps.mp(dm.sends[k], c);
+    MPI_Isend(&dm.sbuf[3 * dm.sstart[p]],
+      3 * (dm.sstart[p + 1] - dm.sstart[p]), MPI_DOUBLE, dm.speers[p], 2,
+      dm.comm, &dm.requests[rq++]);
+  }
+
+  dm.pending = true;
+#else
+  (void) dm;
+  (void) ps;
+#endif
+}
+
+/** 
+ * \brief Wait for the positions of the ghosts posted by domain_post().
+ *
+ * Nothing happens if no positions are on their way.
+ *
+ * \param[in,out] dm Reference to the domain.
+ * \param[in,out] ps Reference to the particles; the positions of the ghosts
+ *                   are set. */
+void domain_wait(Domain &dm, Particles &ps) {
+#ifdef USE_MPI
+  if (!dm.pending)
+    return;
+
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+  MPI_Waitall(dm.requests.size(), dm.requests.data(), MPI_STATUSES_IGNORE);
+  dm.waited += std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+
+  for (size_t k = 0; k < dm.recvs.size(); k++) {
+    int g = dm.recvs[k];
+    for (int c = 0; c < 3; c++)
+      ps.mp(ps.n + g, c) = dm.rbuf[3 * k + c] + dm.shifts[3 * g + c];
+  }
+
+  dm.pending = false;
+#else
+  (void) dm;
+  (void) ps;
+#endif
+}
+
+/** 
+ * \brief Send the current positions of the particles to their ghosts and
+ *        wait for them.
+ * \param[in,out] dm Reference to the domain.
+ * \param[in,out] ps Reference to the particles; the positions of the ghosts
+ *                   are set. */
+void domain_forward(Domain &dm, Particles &ps) {
+  domain_post(dm, ps);
+  domain_wait(dm, ps);
+}
+
+/** 
+ * \brief Send the accelerations of the ghosts back and add them to their
+ *        owners.
+ *
+ * The accelerations from the ranks are added in the order of the ranks, so
+ * the sums come out the same on every run. Afterwards the rows of the ghosts
+ * are zero again.
+ *
+ * \param[in,out] dm Reference to the domain.
+ * \param[in] ps Reference to the particles.
+ * \param[in,out] ma Accelerations of the particles and ghosts /(m/s^2). */
+void domain_reverse(Domain &dm, const Particles &ps, MatrixX3d &ma) {
+#ifdef USE_MPI
+  if (dm.size == 1)
+    return;
+
+  int rq = 0;
+  for (size_t p = 0; p < dm.speers.size(); p++)
+    MPI_Irecv(&dm.rbuf[3 * dm.sstart[p]],
+      3 * (dm.sstart[p + 1] - dm.sstart[p]), MPI_DOUBLE, dm.speers[p], 3,
+      dm.comm, &dm.requests[rq++]);
+
+  for (size_t p = 0; p < dm.rpeers.size(); p++) {
+    for (int k = dm.rstart[p]; k < dm.rstart[p + 1]; k++)
+      for (int c = 0; c < 3; c++)
+        dm.sbuf[3 * k + c] = ma(ps.n + dm.recvs[k], c);
+    MPI_Isend(&dm.sbuf[3 * dm.rstart[p]],
+      3 * (dm.rstart[p + 1] - dm.rstart[p]), MPI_DOUBLE, dm.rpeers[p], 3,
+      dm.comm, &dm.requests[rq++]);
+  }
+
+  MPI_Waitall(dm.requests.size(), dm.requests.data(), MPI_STATUSES_IGNORE);
+
+  for (size_t k = 0; k < dm.sends.size(); k++)
+    for (int c = 0; c < 3; c++)
+      ma(dm.sends[k], c) += dm.rbuf[3 * k + c];
+
+  ma.middleRows(ps.n, ps.ghosts).setZero();
+#else
+  (void) dm;
+  (void) ps;
+  (void) ma;
+#endif
+}
+
+/** 
+ * \brief Compare the loads of the ranks.
+ * \param[in] dm Reference to the domain.
+ * \param[in] load Load of this rank.
+ * \param[out] ratios Largest and smallest load of the ranks over their mean
+ *                    load; both one without any load.
+ * \return Sum of the loads of all ranks. */
+double domain_imbalance(const Domain &dm, double load, double *ratios) {
+  double total = load, most = load, least = load;
+#ifdef USE_MPI
+  if (dm.size > 1) {
+    MPI_Allreduce(MPI_IN_PLACE, &total, 1, MPI_DOUBLE, MPI_SUM, dm.comm);
+    MPI_Allreduce(MPI_IN_PLACE, &most, 1, MPI_DOUBLE, MPI_MAX, dm.comm);
+    MPI_Allreduce(MPI_IN_PLACE, &least, 1, MPI_DOUBLE, MPI_MIN, dm.comm);
+  }
+#endif
+
+  ratios[0] = ratios[1] = 1;
+  if (total > 0) {
+    ratios[0] = most * dm.size / total;
+    ratios[1] = least * dm.size / total;
+  }
+  return total;
+}
+
+/** 
+ * \brief Shift the borders of the sub-boxes towards an even load of the
+ *        ranks.
+ *
+ * The load of a rank is its force time since the last balancing. Per
+ * dimension the loads of the ranks with the same coordinate are summed up
+ * and taken as spread evenly over their slab of the box. Every inner border
+ * moves BALANCE_DAMPING of the way to the place that splits the summed load
+ * evenly, but less than half of the slabs next to it. So every particle
+ * reaches its new owner in one step of domain_migrate(). No slab gets
+ * narrower than the halo. The particles have to be migrated and the cells
+ * set up again afterwards.
+ *
+ * \param[in,out] dm Reference to the domain.
+ * \param[in] load Force time of this rank since the last balancing /s.
+ * \param[out] ratios Largest and smallest load of the ranks over their mean
+ *                    load before the shift. */
+void domain_balance(Domain &dm, double load, double *ratios) {
+  double total = domain_imbalance(dm, load, ratios);
+
+#ifdef USE_MPI
+  if (dm.size == 1 || !(total > 0))
+    return;
+
+  for (int d = 0; d < 3; d++) {
+    int n = dm.dims[d];
+    if (n == 1)
+      continue;
+
+    std::vector<double> slabs(n, 0);
+    slabs[dm.coords[d]] = load;
+    MPI_Allreduce(MPI_IN_PLACE, slabs.data(), n, MPI_DOUBLE, MPI_SUM,
+      dm.comm);
+
+    // Find the places splitting the load evenly, from the old borders.
+    const std::vector<double> old = dm.cuts[d];
+    std::vector<double> &cuts = dm.cuts[d];
+    double sum = 0;
+    int s = 0;
+    for (int c = 1; c < n; c++) {
+      double target = total * c / n;
+      while (s < n - 1 && sum + slabs[s] <= target)
+        sum += slabs[s++];
+      double x = old[s] + (slabs[s] > 0 ? (target - sum) / slabs[s] : 0) *
+        (old[s + 1] - old[s]);
+
+      x = old[c] + BALANCE_DAMPING * (x - old[c]);
+      x = std::max(x, old[c] - 0.5 * (old[c] - old[c - 1]));
+      cuts[c] = std::min(x, old[c] + 0.5 * (old[c + 1] - old[c]));
+    }
+
+    for (int c = 1; c < n; c++)
+      cuts[c] = std::max(cuts[c], cuts[c - 1] + dm.halo);
+    for (int c = n - 1; c > 0; c--)
+      cuts[c] = std::min(cuts[c], cuts[c + 1] - dm.halo);
+  }
+#else
+  (void) total;
+#endif
+}
+
+/** 
+ * \brief Collect the particles of all ranks on the first one for the
+ *        output.
+ *
+ * The particles of the ranks follow each other in the order of the ranks,
+ * each in its own order. So a checkpoint gives every rank its rows back on a
+ * restart with the same number of ranks.
+ *
+ * \param[in] dm Reference to the domain.
+ * \param[in] st Reference to the state of this rank.
+ * \param[in,out] whole Reference to the state of the whole system, only used
+ *                      on the first rank. Its particles and positions of the
+ *                      last build have to be allocated for all particles. */
+void domain_gather(const Domain &dm, const State &st, State &whole) {
+#ifdef USE_MPI
+  const Particles &ps = st.ps;
+  bool root = dm.rank == 0;
+
+  std::vector<int> counts(dm.size), displs(dm.size, 0);
+  MPI_Gather(&ps.n, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, dm.comm);
+  for (int r = 1; r < dm.size; r++)
+    displs[r] = displs[r - 1] + counts[r - 1];
+
+  const MatrixX3d *src[5] = {&ps.mp, &ps.mv, &ps.ma, &ps.mo, &st.nl.mp0};
+  MatrixX3d *dst[5] = {&whole.ps.mp, &whole.ps.mv, &whole.ps.ma,
+    &whole.ps.mo, &whole.nl.mp0};
+  for (int f = 0; f < 5; f++)
+    for (int k = 0; k < 3; k++)
+      MPI_Gatherv(src[f]->col(k).data(), ps.n, MPI_DOUBLE,
+        root ? dst[f]->col(k).data() : 0, counts.data(), displs.data(),
+        MPI_DOUBLE, 0, dm.comm);
+  MPI_Gatherv(ps.id.data(), ps.n, MPI_INT, root ? whole.ps.id.data() : 0,
+    counts.data(), displs.data(), MPI_INT, 0, dm.comm);
+  MPI_Reduce(&st.nl.length, &whole.nl.length, 1, MPI_LONG, MPI_SUM, 0,
+    dm.comm);
+
+  whole.box = st.box;
+  whole.step = st.step;
+  whole.sorted = st.sorted;
+  whole.generator = st.generator;
+  whole.nl.builds = st.nl.builds;
+  for (int d = 0; d < 3; d++)
+    whole.cuts[d] = st.cuts[d];
+#else
+  (void) dm;
+  (void) st;
+  (void) whole;
+#endif
+}
+
+/** 
+ * \brief Build the neighbour list again as it was at its last build.
+ *
+ * This is used on a restart, so the pairs are summed up in the same order as
+ * before.
+ *
+ * \param[in,out] nl Reference to the neighbour list with the positions of the
+ *                   last build.
+ * \param[in,out] cl Cell list of the box.
+ * \param[in,out] ps Reference to the particles; the ghosts are added.
+ * \param[in] pa Parameters of the simulation.
+ * \param[in,out] dm Reference to the domain. */
+void neighbours_restore(NeighbourList &nl, CellList &cl, Particles &ps,
+  const Parameters &pa, Domain &dm) {
+  Particles old = ps;
+  old.mp = nl.mp0;
+
+  // The ghosts are chosen at the positions of the last build as well.
+  domain_borders(dm, old);
+
+  // The build is no new one for the statistics.
+  int builds = nl.builds;
+  long length = nl.length;
+  neighbours_build(nl, cl, old, pa);
+  nl.builds = builds;
+  nl.length = length;
+
+  // The ghosts follow their owners to the current positions.
+  particles_reserve(ps, old.n + old.ghosts);
+  ps.ghosts = old.ghosts;
+  ps.id = old.id;
+  domain_forward(dm, ps);
+}
+
+/**
+ * \brief Buffers of the threads of the force calculation, kept between the
+ *        calls. */
+struct AccelBuffers {
+  // Accelerations of all threads but the first one.
+  std::vector<MatrixX3d> ma;
+
+  // Potential energy and virial of every thread.
+  std::vector<double> sums;
+};
+
+/** 
+ * \brief Allocate the buffers of the threads before the first force
+ *        calculation.
+ * \param[out] buffers Reference to the buffers.
+ * \param[in] rows Number of rows of the acceleration matrix. */
+void accel_buffers(AccelBuffers &buffers, int rows) {
+  int tc = 1;
+#ifdef _OPENMP
+  tc = omp_get_max_threads();
+#endif
+
+  buffers.ma.resize(tc - 1);
+  for (int b = 0; b < tc - 1; b++)
+    buffers.ma[b].setZero(rows, 3);
+  buffers.sums.assign(2 * tc, 0);
+}
+
+/** 
+ * \brief Find the part of the main particles of one thread with about the
+ *        same number of pairs as the other threads.
+ * \param[in] nl Neighbour list to split.
+ * \param[in] n Number of main particles.
+ * \param[in] t Number of the thread.
+ * \param[in] tc Number of threads.
+ * \param[out] p0 First main particle of the thread.
+ * \param[out] p1 Main particle behind the last one of the thread. */
+inline void accel_part(const NeighbourList &nl, int n, int t, int tc, int &p0,
+  int &p1) {
+  int pc = nl.start[n];
+  p0 = std::lower_bound(nl.start.begin(), nl.start.end() - 1,
+    (long) pc * t / tc) - nl.start.begin();
+  p1 = std::lower_bound(nl.start.begin(), nl.start.end() - 1,
+    (long) pc * (t + 1) / tc) - nl.start.begin();
+  if (t == tc - 1)
+    p1 = n;
+}
+
+/** 
+ * \brief Prepare the hardware counters of the force calculation.
+ *
+ * The counters themselves are opened by the threads of the force
+ * calculation, see counters_thread().
+ *
+ * \param[out] cn Reference to the counters. */
+void counters_open(Counters &cn) {
+  static long counted = 0;
+
+  int tc = 1;
+#ifdef _OPENMP
+  tc = omp_get_max_threads();
+#endif
+  cn.threads = 0;
+  cn.fds.clear();
+  cn.fds.reserve(tc * COUNTERS);
+  cn.id = ++counted;
+  cn.enabled = false;
+  cn.pairs = 0;
+  for (int e = 0; e < COUNTERS; e++)
+    cn.values[e] = -1;
+}
+
+/** 
+ * \brief Open the hardware counters of the calling thread, unless it has
+ *        them already.
+ *
+ * A counter only sees the thread that opened it, and OpenMP does not promise
+ * the same threads for every parallel region. So every thread of the force
+ * calculation calls this at its start and a thread new to the counting opens
+ * its own group. Events the processor or the system does not allow are left
+ * out. Counting may need a low /proc/sys/kernel/perf_event_paranoid.
+ *
+ * \param[in,out] cn Reference to the counters. */
+inline void counters_thread(Counters &cn) {
+#ifdef __linux__
+  // Counting the thread has its counters open for.
+  static thread_local long opened = 0;
+  if (opened == cn.id)
+    return;
+  opened = cn.id;
+
+  // Type and configuration of every event. The floating point instructions
+  // are the raw event FP_ARITH_INST_RETIRED for single and double precision,
+  // so the mixed precision kernels are counted as well.
+  const uint32_t types[COUNTERS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+    PERF_TYPE_HARDWARE, PERF_TYPE_RAW, PERF_TYPE_RAW};
+  const uint64_t configs[COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, 0x03c7, 0xfcc7};
+
+  bool intel = false;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  intel = __builtin_cpu_is("intel");
+#endif
+
+  int fds[COUNTERS];
+  for (int e = 0; e < COUNTERS; e++)
+    fds[e] = -1;
+
+  for (int e = 0; e < COUNTERS; e++) {
+    if (types[e] == PERF_TYPE_RAW && !intel)
+      continue;
+
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = types[e];
+    attr.config = configs[e];
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+      PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    // Only the leader of the group is switched on and off. A thread joining
+    // while the counters are on starts counting right away.
+    attr.disabled = e == COUNTER_CYCLES && !cn.enabled;
+    fds[e] = syscall(__NR_perf_event_open, &attr, 0, -1,
+      e == COUNTER_CYCLES ? -1 : fds[COUNTER_CYCLES], 0);
+
+    // Without cycles there is no group at all.
+    if (fds[COUNTER_CYCLES] < 0)
+      return;
+  }
+
+#pragma omp critical (counters)
+  {
+    cn.fds.insert(cn.fds.end(), fds, fds + COUNTERS);
+    cn.threads++;
+  }
+#else
+  (void) cn;
+#endif
+}
+
+/** 
+ * \brief Switch the hardware counters of all threads on or off.
+ *
+ * Called outside of the force calculation only, while no thread opens its
+ * counters.
+ *
+ * \param[in,out] cn Reference to the counters.
+ * \param[in] on True for switching on, false for switching off. */
+inline void counters_enable(Counters &cn, bool on) {
+  cn.enabled = on;
+#ifdef __linux__
+  for (int t = 0; t < cn.threads; t++)
+    ioctl(cn.fds[t * COUNTERS + COUNTER_CYCLES],
+      on ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE,
+      PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+/** 
+ * \brief Read and close the hardware counters of all threads.
+ *
+ * If the processor had to share its counters with other groups, the values
+ * are scaled up to the whole time the counters were switched on.
+ *
+ * \param[in,out] cn Reference to the counters. */
+void counters_close(Counters &cn) {
+#ifdef __linux__
+  for (int t = 0; t < cn.threads; t++) {
+    int *fds = &cn.fds[t * COUNTERS];
+
+    // Number of events, time switched on and time counted, followed by the
+    // values of the opened events in the order of opening.
+    uint64_t data[3 + COUNTERS];
+    if (read(fds[COUNTER_CYCLES], data, sizeof(data)) > 0 && data[2] > 0) {
+      double scale = (double) data[1] / data[2];
+      for (int e = 0, v = 3; e < COUNTERS; e++) {
+        if (fds[e] < 0)
+          continue;
+        cn.values[e] = std::max(cn.values[e], 0LL) +
+          (long long) (data[v++] * scale);
+      }
+    }
+
+    for (int e = 0; e < COUNTERS; e++)
+      if (fds[e] >= 0)
+        close(fds[e]);
+  }
+#endif
+  cn.fds.clear();
+  cn.threads = 0;
+}
+
+/** 
+ * \brief Calculation of the particle accelerations based on the resulting 
+ *        forces.
+ *
+ * Every thread handles a part of the main particles with about the same
+ * number of pairs. Cause of the third Newton's-Law a thread also changes the
+ * accelerations of particles outside its part, so every thread but the first
+ * one sums up into its own buffer. At the end the buffers are added to the
+ * accelerations in a fixed order, which gives the same result for the same
+ * number of threads on every run. The same holds for the potential energy
+ * and the virial, if they are wanted.
+ *
+ * With the pairs with ghosts in a list of their own, the first list is
+ * calculated while the positions of the ghosts may still be on their way.
+ * Then the first thread waits for them and all threads go on with the pairs
+ * with ghosts.
+ *
+ * \param[in,out] ps Reference to the particles; the accelerations are
+ *                   calculated from the positions. The outer range goes to
+ *                   the outer accelerations, the others to ma.
+ * \param[in] nl Neighbour list that is valid for the given positions and
+ *               holds all pairs of the range, or all pairs of own particles
+ *               if halo is given.
+ * \param[in] box Reference to the box.
+ * \param[in] pa Parameters of the simulation.
+ * \param[in] kernel Force kernel selected for the CPU and the parameters.
+ * \param[in] range Range of the force, one of the RANGE_ values.
+ * \param[in,out] buffers Buffers of the threads, kept between the calls.
+ * \param[out] sums Potential energy /J and virial /J of all pairs; 0 if they
+ *                  are not wanted.
+ * \param[in] halo Neighbour list of the pairs with ghosts; 0 if nl holds all
+ *                 pairs.
+ * \param[in,out] dm Domain the positions of the ghosts are waited for from,
+ *                   if halo is given.
+ * \param[in,out] cn Hardware counters the threads open theirs for; 0 if
+ *                   nothing is counted. */
+void accel(Particles &ps, const NeighbourList &nl, const Box &box,
+  const Parameters &pa, const Kernel &kernel, int range,
+  AccelBuffers &buffers, double *sums, const NeighbourList *halo = 0,
+  Domain *dm = 0, Counters *cn = 0) {
+  MatrixX3d &out = range == RANGE_OUTER ? ps.mo : ps.ma;
+
+  // Only the pairs are calculated in single precision.
+  if (kernel.mixed)
+    ps.mf = ps.mp.cast<float>();
+
+#pragma omp parallel
+  {
+    int t = 0, tc = 1;
+#ifdef _OPENMP
+    t = omp_get_thread_num();
+    tc = omp_get_num_threads();
+#endif
+    if (cn)
+      counters_thread(*cn);
+
+#pragma omp single
+    {
+      buffers.ma.resize(tc - 1);
+      buffers.sums.resize(2 * tc);
+    }
+
+    // Empty the own acceleration matrix and sums.
+    MatrixX3d &ma = t == 0 ? out : buffers.ma[t - 1];
+    ma.setZero(ps.mp.rows(), 3);
+    double *ts = &buffers.sums[2 * t];
+    ts[0] = ts[1] = 0;
+
+    // Split the main particles by the number of pairs.
+    int p0, p1;
+    accel_part(nl, ps.n, t, tc, p0, p1);
+    if (sums)
+      kernel.energy[range](ps, nl, box, p0, p1, pa, ma, ts);
+    else
+      kernel.accel[range](ps, nl, box, p0, p1, pa, ma, ts);
+
+    if (halo) {
+#pragma omp master
+      {
+        domain_wait(*dm, ps);
+        if (kernel.mixed)
+          ps.mf.middleRows(ps.n, ps.ghosts) =
+            ps.mp.middleRows(ps.n, ps.ghosts).cast<float>();
+      }
+#pragma omp barrier
+
+      accel_part(*halo, ps.n, t, tc, p0, p1);
+      if (sums)
+        kernel.energy[range](ps, *halo, box, p0, p1, pa, ma, ts);
+      else
+        kernel.accel[range](ps, *halo, box, p0, p1, pa, ma, ts);
+    }
+
+#pragma omp barrier
+
+    // Every thread adds up the buffers for its part of the rows.
+    int rows = ps.mp.rows() / SIMD_WIDTH;
+    int r0 = rows * t / tc * SIMD_WIDTH, r1 = rows * (t + 1) / tc * SIMD_WIDTH;
+    for (int b = 0; b < tc - 1; b++)
+      out.middleRows(r0, r1 - r0) += buffers.ma[b].middleRows(r0, r1 - r0);
+
+    // The kernels sum up the virial divided by the mass.
+#pragma omp master
+    if (sums) {
+      sums[0] = sums[1] = 0;
+      for (int b = 0; b < tc; b++) {
+        sums[0] += buffers.sums[2 * b];
+        sums[1] += buffers.sums[2 * b + 1] * pa.mass;
+      }
+    }
+  }
+}
+
+/** 
+ * \brief Test whether a path exist or not.
+ * \return True if path exist, else false. */
+bool path_exist(const char * const path) {
+  struct stat my_stat;
+  return (stat(path, &my_stat) == 0);
+}
+
+/** 
+ * \brief Initialize serialization.
+ *
+ * Create the output path given by the parameters if neccessary. Without one
+ * a new path is named by the current date.
+ *
+ * \param[in] pa Parameters of the simulation.
+ * \return Name of the output path. */
+std::string init_serialize(const Parameters &pa) {
+  const mode_t mode = S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IWGRP |
+    S_IXGRP;
+
+  if (!pa.output.empty()) {
+    std::string path = pa.output;
+    if (path[path.size() - 1] != '/')
+      path += '/';
+    if (!path_exist(path.c_str()))
+      mkdir(path.c_str(), mode);
+    return path;
+  }
+
+  // Time data object for getting the raw data.
+  time_t rawtime;
+  struct tm *timeinfo;
+
+  // String containing the time information in the right format.
+  char tbuf[80];
+
+  // Get current datetime from the time object.
+  time(&rawtime);
+  timeinfo = localtime(&rawtime);
+
+  // Convert the datetime information to string.
+  strftime(tbuf, sizeof(tbuf), "%d-%m-%Y_%I-%M-%S", timeinfo);
+
+  // Create final path as string with prefix.
+  std::string path = std::string("mds-") + std::string(tbuf) + std::string("/");
+  mkdir(path.c_str(), mode);
+
+  return path;
+}
+
+/** 
+ * \brief Continue a binary trajectory file of an earlier run.
+ *
+ * The frames up to the step of the checkpoint are kept and the ones behind
+ * it are cut off, so the new frames follow without a gap. The steps of the
+ * frames are read from the frames themselves, as the index and the number
+ * of frames are missing if the earlier run was stopped.
+ *
+ * \param[in,out] tr Reference to the trajectory with the header of the new
+ *                   run.
+ * \param[in] file Name of the file.
+ * \param[in] step Number of finished time steps of the checkpoint.
+ * \return True if the file fits the new run and could be continued, else
+ *         false. */
+bool trajectory_continue(Trajectory &tr, const std::string &file,
+  int64_t step) {
+  const TrajectoryHeader &h = tr.header;
+  TrajectoryHeader old;
+  std::ifstream in(file.c_str(), std::ios::binary);
+  if (!in.read((char *) &old, sizeof(old)) ||
+      std::memcmp(old.magic, h.magic, 8) != 0 || old.version != h.version ||
+      old.precision != h.precision || old.field != h.field ||
+      old.stride != h.stride || old.first != h.first ||
+      old.particles != h.particles) {
+    std::cout << "Error: Trajectory does not fit the restart: " << file
+	      << std::endl;
+    return false;
+  }
+
+  // Without an index the file ends after the last complete frame.
+  in.seekg(0, std::ios::end);
+  int64_t frames = old.index > 0 ? old.frames :
+    ((int64_t) in.tellg() - (int64_t) sizeof(old)) / h.frame_size;
+
+  int64_t kept = 0, s;
+  for (; kept < frames; kept++) {
+    in.seekg(sizeof(old) + kept * h.frame_size);
+    if (!in.read((char *) &s, sizeof(s)) || s > step)
+      break;
+    tr.steps.push_back(s);
+  }
+  in.close();
+
+  int64_t size = sizeof(old) + kept * h.frame_size;
+  if (truncate(file.c_str(), size) != 0) {
+    std::cout << "Error: Could not continue the trajectory: " << file
+	      << std::endl;
+    return false;
+  }
+
+  tr.out.open(file.c_str(), std::ios::binary | std::ios::in |
+    std::ios::out);
+  tr.out.seekp(size);
+  return (bool) tr.out;
+}
+
+/** 
+ * \brief Open a text file with one line per entry, led by its time step.
+ *
+ * On a restart an existing file is continued: the entries behind the
+ * checkpoint are dropped and the new ones are appended. Empty lines and
+ * lines starting with # are kept.
+ *
+ * \param[out] out Reference to the output stream.
+ * \param[in] file Name of the file.
+ * \param[in] head Head lines of a new file.
+ * \param[in] limit First time step behind the checkpoint on a restart, else
+ *                  -1 for a new file. */
+void text_open(std::ofstream &out, const std::string &file, const char *head,
+  int64_t limit) {
+  std::string kept = head;
+  if (limit >= 0 && path_exist(file.c_str())) {
+    std::ifstream in(file.c_str());
+    std::string line;
+    long long step;
+    kept.clear();
+    while (std::getline(in, line)) {
+      std::istringstream ls(line);
+      if (line.empty() || line[0] == '#' || (ls >> step && step < limit))
+        kept += line + '\n';
+    }
+  }
+
+  out.open(file.c_str());
+  out << kept;
+}
+
+/** 
+ * \brief Open a binary trajectory file and write its header.
+ *
+ * On a restart an existing file is continued by trajectory_continue().
+ *
+ * \param[out] tr Reference to the trajectory.
+ * \param[in] file Name of the file.
+ * \param[in] field Field written to the file, one of the FIELD_ values.
+ * \param[in] stride Time steps between two frames.
+ * \param[in] first First written particle.
+ * \param[in] count Number of written particles.
+ * \param[in] box Reference to the box.
+ * \param[in] pa Parameters of the simulation.
+ * \param[in] step Number of finished time steps of the checkpoint on a
+ *                 restart, else -1.
+ * \return True if the file could be opened, else false. */
+bool trajectory_open(Trajectory &tr, const std::string &file, int field,
+  int stride, int first, int count, const Box &box, const Parameters &pa,
+  int64_t step) {
+  std::memset(&tr.header, 0, sizeof(tr.header));
+  std::memcpy(tr.header.magic, "SIMLJTRJ", 8);
+  tr.header.version = 2;
+  tr.header.precision = pa.precision;
+  tr.header.field = field;
+  tr.header.stride = stride;
+  tr.header.first = first;
+  tr.header.particles = count;
+  tr.header.frame_size = sizeof(int64_t) + 3 * (int64_t) count *
+    pa.precision;
+  tr.header.timestep = pa.timestep;
+
+  tr.header.box[0] = box.left;
+  tr.header.box[1] = box.right;
+  tr.header.box[2] = box.top;
+  tr.header.box[3] = box.bottom;
+  tr.header.box[4] = box.front;
+  tr.header.box[5] = box.back;
+
+  // Allocate all buffers before the simulation starts.
+  tr.steps.clear();
+  tr.steps.reserve(pa.timesteps / stride + 1);
+  tr.buffer.resize(pa.precision == 4 ? count : 0);
+
+  if (step >= 0 && path_exist(file.c_str()))
+    return trajectory_continue(tr, file, step);
+
+  tr.out.open(file.c_str(), std::ios::binary);
+  tr.out.write((const char *) &tr.header, sizeof(tr.header));
+  return (bool) tr.out;
+}
+
+/** 
+ * \brief Write one component stream of the written particles.
+ * \param[in,out] tr Reference to the trajectory.
+ * \param[in] x Pointer to the first written particle of the stream.
+ * \param[in] n Number of written particles. */
+void trajectory_stream(Trajectory &tr, const double *x, int n) {
+  if (tr.header.precision == 8) {
+    tr.out.write((const char *) x, n * sizeof(double));
+  } else {
+    for (int pi = 0; pi < n; pi++)
+      tr.buffer[pi] = (float) x[pi];
+    tr.out.write((const char *) tr.buffer.data(), n * sizeof(float));
+  }
+}
+
+/** 
+ * \brief Append one field of the particles as frame.
+ * \param[in,out] tr Reference to the trajectory.
+ * \param[in] m Reference to the matrix of the field.
+ * \param[in] step Number of the time step. */
+void trajectory_write(Trajectory &tr, const MatrixX3d &m, int64_t step) {
+  tr.out.write((const char *) &step, sizeof(step));
+
+  for (int d = 0; d < 3; d++)
+    trajectory_stream(tr, m.col(d).data() + tr.header.first,
+      tr.header.particles);
+
+  tr.steps.push_back(step);
+}
+
+/** 
+ * \brief Write the index, complete the header and close the trajectory.
+ * \param[in,out] tr Reference to the trajectory. */
+void trajectory_close(Trajectory &tr) {
+  tr.header.frames = tr.steps.size();
+  tr.header.index = sizeof(tr.header) + tr.header.frames *
+    tr.header.frame_size;
+
+  tr.out.write((const char *) tr.steps.data(),
+    tr.steps.size() * sizeof(int64_t));
+
+  // Write the header again with the final number of frames.
+  tr.out.seekp(0);
+  tr.out.write((const char *) &tr.header, sizeof(tr.header));
+
+  tr.out.close();
+  if (!tr.out)
+    std::cout << "Error: Writing the trajectory failed." << std::endl;
+}
+
+/** 
+ * \brief Write the snapshots handed over to the writer until it is stopped.
+ * \param[in,out] w Pointer to the writer. */
+void writer_run(Writer *w) {
+#ifdef CHECK_ALLOCATIONS
+  uncounted = true;
+#endif
+  std::unique_lock<std::mutex> lock(w->mutex);
+
+  while (true) {
+    w->cond.wait(lock, [w] { return w->written < w->pushed || w->done; });
+    if (w->written == w->pushed)
+      break;
+
+    // Write without holding the lock, so the simulation can fill the other
+    // snapshots meanwhile.
+    int si = w->written % WRITER_BUFFERS;
+    lock.unlock();
+
+    const Particles &snap = w->snapshots[si];
+    if (w->fields[si] & (1 << FIELD_POSITIONS))
+      trajectory_write(w->tr[FIELD_POSITIONS], snap.mp, w->steps[si]);
+    if (w->fields[si] & (1 << FIELD_VELOCITIES))
+      trajectory_write(w->tr[FIELD_VELOCITIES], snap.mv, w->steps[si]);
+    if (w->fields[si] & (1 << FIELD_FORCES))
+      trajectory_write(w->tr[FIELD_FORCES], snap.ma, w->steps[si]);
+
+    lock.lock();
+    w->written++;
+    w->cond.notify_all();
+  }
+}
+
+/** 
+ * \brief Open the trajectory files and start the writer thread.
+ *
+ * Every field with a stride gets its own file in the output path. Only the
+ * particles selected by the output parameters are written. On a restart the
+ * existing files are continued.
+ *
+ * \param[out] w Reference to the writer.
+ * \param[in] path Output path for the files.
+ * \param[in] ps Reference to the particles.
+ * \param[in] box Reference to the box.
+ * \param[in] pa Parameters of the simulation.
+ * \param[in] step Number of finished time steps of the checkpoint on a
+ *                 restart, else -1.
+ * \return True if all files could be opened, else false. Then the thread is
+ *         not started. */
+bool writer_start(Writer &w, const std::string &path, const Particles &ps,
+  const Box &box, const Parameters &pa, int64_t step) {
+  static const char * const names[FIELDS] = {"positions", "velocities",
+    "forces"};
+
+  for (int f = 0; f < FIELDS; f++)
+    w.strides[f] = pa.strides[f];
+
+  // Keep the selection of particles inside of the existing ones.
+  w.first = std::min(std::max(pa.output_first, 0L), (long) ps.n);
+  w.count = pa.output_count < 0 ? ps.n - w.first :
+    std::min(pa.output_count, (long) ps.n - w.first);
+  w.mass = pa.mass;
+  w.respa = pa.respa > 1;
+
+  for (int f = 0; f < FIELDS; f++)
+    if (w.strides[f] > 0 &&
+        !trajectory_open(w.tr[f], path + names[f] + ".bin", f, w.strides[f],
+          w.first, w.count, box, pa, step))
+      return false;
+
+  for (int si = 0; si < WRITER_BUFFERS; si++)
+    particles_init(w.snapshots[si], ps.n);
+
+  w.pushed = 0;
+  w.written = 0;
+  w.stalls = 0;
+  w.done = false;
+  w.thread = std::thread(writer_run, &w);
+  return true;
+}
+
+/** 
+ * \brief Copy one field of the written particles to the rows of their IDs.
+ * \param[out] dst Reference to the field of the snapshot.
+ * \param[in] src Reference to the field of the particles.
+ * \param[in] ps Reference to the particles.
+ * \param[in] first First written particle.
+ * \param[in] count Number of written particles.
+ * \param[in] scale Factor for every value.
+ * \param[in] add True if the values are added to the snapshot, else they
+ *                replace it. */
+inline void writer_copy(MatrixX3d &dst, const MatrixX3d &src,
+  const Particles &ps, int first, int count, double scale, bool add) {
+  for (int d = 0; d < 3; d++) {
+    const double *x = src.col(d).data();
+    double *y = dst.col(d).data();
+    for (int pi = 0; pi < ps.n; pi++) {
+      int id = ps.id[pi];
+      if (id >= first && id < first + count)
+        y[id] = add ? y[id] + x[pi] * scale : x[pi] * scale;
+    }
+  }
+}
+
+/** 
+ * \brief Find the fields due in a time step.
+ * \param[in] strides Time steps between two frames of every field; 0 if it
+ *                    is not written.
+ * \param[in] step Number of finished time steps.
+ * \return Bit 1 << f set for every due field f. */
+int writer_fields(const int *strides, int64_t step) {
+  int fields = 0;
+  for (int f = 0; f < FIELDS; f++)
+    if (strides[f] > 0 && step % strides[f] == 0)
+      fields |= 1 << f;
+  return fields;
+}
+
+/** 
+ * \brief Hand over the fields of the particles due in a time step to the
+ *        writer.
+ *
+ * Nothing happens if no field is due. The call blocks only while all
+ * snapshots are still waiting to be written.
+ *
+ * \param[in,out] w Reference to the writer.
+ * \param[in] ps Reference to the particles.
+ * \param[in] step Number of finished time steps. */
+void writer_push(Writer &w, const Particles &ps, int64_t step) {
+  int fields = writer_fields(w.strides, step);
+  if (fields == 0)
+    return;
+
+  std::unique_lock<std::mutex> lock(w.mutex);
+  if (w.pushed - w.written == WRITER_BUFFERS) {
+    w.stalls++;
+    w.cond.wait(lock, [&w] { return w.pushed - w.written < WRITER_BUFFERS; });
+  }
+  lock.unlock();
+
+  // The snapshot is not used by the thread until it is handed over. Only the
+  // written particles are copied, back in the order of their IDs.
+  int si = w.pushed % WRITER_BUFFERS;
+  Particles &snap = w.snapshots[si];
+  if (fields & (1 << FIELD_POSITIONS))
+    writer_copy(snap.mp, ps.mp, ps, w.first, w.count, 1, false);
+  if (fields & (1 << FIELD_VELOCITIES))
+    writer_copy(snap.mv, ps.mv, ps, w.first, w.count, 1, false);
+  if (fields & (1 << FIELD_FORCES)) {
+    writer_copy(snap.ma, ps.ma, ps, w.first, w.count, w.mass, false);
+    if (w.respa)
+      writer_copy(snap.ma, ps.mo, ps, w.first, w.count, w.mass, true);
+  }
+  w.fields[si] = fields;
+  w.steps[si] = step;
+
+  lock.lock();
+  w.pushed++;
+  w.cond.notify_all();
+}
+
+/** 
+ * \brief Write the remaining snapshots, stop the thread and close the
+ *        trajectory files.
+ * \param[in,out] w Reference to the writer. */
+void writer_stop(Writer &w) {
+  {
+    std::lock_guard<std::mutex> lock(w.mutex);
+    w.done = true;
+    w.cond.notify_all();
+  }
+
+  w.thread.join();
+
+  for (int f = 0; f < FIELDS; f++)
+    if (w.strides[f] > 0)
+      trajectory_close(w.tr[f]);
+}
+
+/** 
+ * \brief Write a checkpoint of the whole simulation state.
+ *
+ * The checkpoint is written to a temporary file first, which replaces the
+ * old checkpoint on success only. The file is flushed to the disk before,
+ * and the directory after the renaming. So there is always a complete
+ * checkpoint, even if the program is stopped or the machine fails while
+ * writing.
+ *
+ * \param[in] st Reference to the state.
+ * \param[in] file Name of the checkpoint file.
+ * \param[in] pa Parameters of the simulation. */
+void checkpoint_write(const State &st, const std::string &file,
+  const Parameters &pa) {
+  std::ostringstream gs;
+  gs << st.generator;
+  std::string generator = gs.str();
+
+  CheckpointHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, "SIMLJCHK", 8);
+  header.version = 4;
+  header.closed = st.box.closed;
+  header.particles = st.ps.n;
+  header.rows = st.ps.mp.rows();
+  header.step = st.step;
+  header.sorted = st.sorted;
+  header.sigma = pa.sigma;
+  header.epsilon = pa.epsilon;
+  header.mass = pa.mass;
+  header.timestep = pa.timestep;
+  header.rcut = pa.rcut;
+  header.skin = pa.skin;
+  header.shift = pa.shift;
+  header.rinner = pa.rinner;
+  header.respa = pa.respa;
+  header.generator = generator.size();
+  for (int d = 0; d < 3; d++)
+    header.dims[d] = st.cuts[d].empty() ? 0 : st.cuts[d].size() - 1;
+  header.box[0] = st.box.left;
+  header.box[1] = st.box.right;
+  header.box[2] = st.box.top;
+  header.box[3] = st.box.bottom;
+  header.box[4] = st.box.front;
+  header.box[5] = st.box.back;
+  header.builds = st.nl.builds;
+  header.length = st.nl.length;
+
+  std::string tmp = file + ".tmp";
+  std::ofstream out(tmp.c_str(), std::ios::binary);
+  std::streamsize size = header.rows * 3 * sizeof(double);
+
+  out.write((const char *) &header, sizeof(header));
+  out.write((const char *) st.ps.mp.data(), size);
+  out.write((const char *) st.ps.mv.data(), size);
+  out.write((const char *) st.ps.ma.data(), size);
+  out.write((const char *) st.ps.mo.data(), size);
+  out.write((const char *) st.nl.mp0.data(), size);
+  out.write((const char *) st.ps.id.data(), st.ps.n * sizeof(int32_t));
+  out.write(generator.data(), generator.size());
+  for (int d = 0; d < 3; d++)
+    out.write((const char *) st.cuts[d].data(),
+      st.cuts[d].size() * sizeof(double));
+  out.close();
+
+  // Flush the data before the renaming, so the new name never points to
+  // lost data. Then flush the directory with the new name.
+  bool synced = false;
+  int fd = open(tmp.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    synced = fsync(fd) == 0;
+    close(fd);
+  }
+
+  if (!out || !synced || std::rename(tmp.c_str(), file.c_str()) != 0) {
+    std::cout << "Error: Writing the checkpoint failed." << std::endl;
+    return;
+  }
+
+  size_t slash = file.rfind('/');
+  std::string dir = slash == std::string::npos ? "." :
+    file.substr(0, slash + 1);
+  fd = open(dir.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+/** 
+ * \brief Read the whole simulation state from a checkpoint.
+ * \param[out] st Reference to the state.
+ * \param[in] file Name of the checkpoint file.
+ * \param[in] pa Parameters of the simulation. The number of particles is
+ *               taken from the checkpoint.
+ * \return True if the checkpoint could be read and fits the parameters,
+ *         else false. */
+bool checkpoint_read(State &st, const std::string &file,
+  const Parameters &pa) {
+  std::ifstream in(file.c_str(), std::ios::binary);
+
+  CheckpointHeader header;
+  if (!in.read((char *) &header, sizeof(header)) ||
+      std::memcmp(header.magic, "SIMLJCHK", 8) != 0 || header.version != 4) {
+    std::cout << "Error: No checkpoint: " << file << std::endl;
+    return false;
+  }
+
+  // The simulation can only go on with the same parameters.
+  if (header.sigma != pa.sigma || header.epsilon != pa.epsilon ||
+      header.mass != pa.mass || header.timestep != pa.timestep ||
+      header.rcut != pa.rcut || header.skin != pa.skin ||
+      header.shift != pa.shift || header.closed != pa.closed ||
+      header.respa != pa.respa || header.rinner != pa.rinner) {
+    std::cout << "Error: Checkpoint with other parameters: " << file
+	      << std::endl;
+    return false;
+  }
+
+  particles_init(st.ps, header.particles);
+  if (st.ps.mp.rows() != header.rows) {
+    std::cout << "Error: Checkpoint with other padding: " << file << std::endl;
+    return false;
+  }
+
+  st.nl.mp0.resize(header.rows, 3);
+  std::streamsize size = header.rows * 3 * sizeof(double);
+  std::string generator(header.generator, ' ');
+
+  in.read((char *) st.ps.mp.data(), size);
+  in.read((char *) st.ps.mv.data(), size);
+  in.read((char *) st.ps.ma.data(), size);
+  in.read((char *) st.ps.mo.data(), size);
+  in.read((char *) st.nl.mp0.data(), size);
+  in.read((char *) st.ps.id.data(), st.ps.n * sizeof(int32_t));
+  in.read(&generator[0], generator.size());
+  for (int d = 0; d < 3; d++) {
+    st.cuts[d].resize(header.dims[d] > 0 ? header.dims[d] + 1 : 0);
+    in.read((char *) st.cuts[d].data(), st.cuts[d].size() * sizeof(double));
+  }
+  if (!in) {
+    std::cout << "Error: Checkpoint is incomplete: " << file << std::endl;
+    return false;
+  }
+
+  std::istringstream gs(generator);
+  gs >> st.generator;
+
+  st.step = header.step;
+  st.sorted = header.sorted;
+  st.box.left = header.box[0];
+  st.box.right = header.box[1];
+  st.box.top = header.box[2];
+  st.box.bottom = header.box[3];
+  st.box.front = header.box[4];
+  st.box.back = header.box[5];
+  st.box.closed = header.closed;
+  st.nl.builds = header.builds;
+  st.nl.length = header.length;
+
+  return true;
+}
+
+/** 
+ * \brief Set all parameters to their defaults.
+ * \param[out] pa Reference to the parameters. */
+void params_default(Parameters &pa) {
+  pa.sigma = SIGMA;
+  pa.epsilon = EPSILON;
+  pa.mass = MASS;
+  pa.particles = TOTAL_PARTICLE;
+  pa.timesteps = TOTAL_TIMESTEPS;
+  pa.timestep = TIMESTEP;
+  pa.temp = TEMP;
+  pa.rcut = RCUT;
+  pa.skin = SKIN;
+  pa.respa = RESPA;
+  pa.rinner = RINNER;
+  pa.shift = SHIFT;
+  pa.closed = CLOSED;
+  pa.threads = 0;
+  pa.precision = TRAJECTORY_PRECISION;
+  pa.strides[FIELD_POSITIONS] = POSITION_STRIDE;
+  pa.strides[FIELD_VELOCITIES] = VELOCITY_STRIDE;
+  pa.strides[FIELD_FORCES] = FORCE_STRIDE;
+  pa.output_first = OUTPUT_FIRST;
+  pa.output_count = OUTPUT_COUNT;
+  pa.checkpoint_stride = CHECKPOINT_STRIDE;
+  pa.sort_stride = SORT_STRIDE;
+  pa.observe_stride = OBSERVE_STRIDE;
+  pa.balance_stride = BALANCE_STRIDE;
+  pa.output.clear();
+  pa.restart.clear();
+  pa.kernel = "auto";
+  pa.benchmark = false;
+  pa.validate = false;
+  pa.counters = 0;
+  pa.mixed = MIXED;
+}
+
+/** 
+ * \brief Set one parameter from its text.
+ *
+ * The names of the parameters are the same in configuration files and on the
+ * command line. Only the format of the value is checked here; the ranges are
+ * checked by params_check() once all parameters are set.
+ *
+ * \param[in,out] pa Reference to the parameters.
+ * \param[in] key Name of the parameter.
+ * \param[in] value Text of the value.
+ * \return True if the parameter exists and the value could be read, else
+ *         false. */
+bool params_set(Parameters &pa, const std::string &key,
+  const std::string &value) {
+  // Parameters with floating point, long and int values.
+  const struct { const char *key; double *value; } doubles[] = {
+    {"sigma", &pa.sigma}, {"epsilon", &pa.epsilon}, {"mass", &pa.mass},
+    {"timestep", &pa.timestep}, {"temperature", &pa.temp},
+    {"rcut", &pa.rcut}, {"skin", &pa.skin}, {"rinner", &pa.rinner}};
+  const struct { const char *key; long *value; } longs[] = {
+    {"particles", &pa.particles}, {"timesteps", &pa.timesteps},
+    {"output_first", &pa.output_first}, {"output_count", &pa.output_count},
+    {"checkpoint_stride", &pa.checkpoint_stride},
+    {"sort_stride", &pa.sort_stride},
+    {"observe_stride", &pa.observe_stride},
+    {"balance_stride", &pa.balance_stride}};
+  const struct { const char *key; int *value; } ints[] = {
+    {"threads", &pa.threads}, {"precision", &pa.precision},
+    {"position_stride", &pa.strides[FIELD_POSITIONS]},
+    {"velocity_stride", &pa.strides[FIELD_VELOCITIES]},
+    {"force_stride", &pa.strides[FIELD_FORCES]}, {"counters", &pa.counters},
+    {"respa", &pa.respa}, {"mixed", &pa.mixed}};
+
+  // Read the value as floating point and as integer number.
+  char *end;
+  double d = std::strtod(value.c_str(), &end);
+  bool isd = !value.empty() && *end == '\0';
+  long l = std::strtol(value.c_str(), &end, 10);
+  bool isl = !value.empty() && *end == '\0';
+
+  bool ok = false;
+  for (const auto &p : doubles)
+    if (key == p.key && (ok = isd))
+      *p.value = d;
+  for (const auto &p : longs)
+    if (key == p.key && (ok = isl))
+      *p.value = l;
+  for (const auto &p : ints)
+    if (key == p.key && (ok = isl && l >= INT_MIN && l <= INT_MAX))
+      *p.value = l;
+
+  if (key == "shift") {
+    ok = value == "none" || value == "energy" || value == "force";
+    pa.shift = value == "none" ? SHIFT_NONE : value == "energy" ?
+      SHIFT_ENERGY : SHIFT_FORCE;
+  } else if (key == "boundary") {
+    ok = value == "closed" || value == "periodic";
+    pa.closed = value == "closed";
+  } else if (key == "output") {
+    ok = true;
+    pa.output = value;
+  } else if (key == "restart") {
+    ok = true;
+    pa.restart = value;
+  } else if (key == "kernel") {
+    ok = value == "auto" || std::find(kernel_names, kernel_names + KERNELS,
+      value) != kernel_names + KERNELS;
+    pa.kernel = value;
+  }
+
+  if (!ok)
+    std::cout << "Error: Unknown parameter or wrong value: " << key << " = "
+	      << value << std::endl;
+  return ok;
+}
+
+/** 
+ * \brief Read parameters from a configuration file.
+ *
+ * Every line holds one parameter as "key = value". Empty lines and
+ * everything behind a # are ignored.
+ *
+ * \param[in,out] pa Reference to the parameters.
+ * \param[in] file Name of the configuration file.
+ * \return True if all lines could be read, else false. */
+bool params_read(Parameters &pa, const std::string &file) {
+  std::ifstream in(file.c_str());
+  if (!in) {
+    std::cout << "Error: No configuration file: " << file << std::endl;
+    return false;
+  }
+
+  static const char * const space = " \t\r";
+  std::string line;
+  for (int ln = 1; std::getline(in, line); ln++) {
+    line = line.substr(0, line.find('#'));
+    if (line.find_first_not_of(space) == std::string::npos)
+      continue;
+
+    // Split the line and strip the spaces around key and value.
+    size_t eq = line.find('=');
+    if (eq == std::string::npos) {
+      std::cout << "Error: Wrong line " << ln << " in " << file << std::endl;
+      return false;
+    }
+    std::string key = line.substr(0, eq), value = line.substr(eq + 1);
+    key.erase(key.find_last_not_of(space) + 1);
+    key.erase(0, key.find_first_not_of(space));
+    value.erase(value.find_last_not_of(space) + 1);
+    value.erase(0, value.find_first_not_of(space));
+
+    if (!params_set(pa, key, value))
+      return false;
+  }
+
+  return true;
+}
+
+/** 
+ * \brief Check that all parameters are in their range.
+ * \param[in] pa Reference to the parameters.
+ * \return True if all parameters are valid, else false. */
+bool params_check(const Parameters &pa) {
+  const char *error = 0;
+  if (!(pa.sigma > 0) || !(pa.epsilon > 0) || !(pa.mass > 0))
+    error = "sigma, epsilon and mass have to be positive";
+  else if (pa.particles <= 0 || pa.particles > INT_MAX)
+    error = "particles has to be a positive int";
+  else if (pa.timesteps < 0)
+    error = "timesteps must not be negative";
+  else if (!(pa.timestep > 0))
+    error = "timestep has to be positive";
+  else if (!(pa.temp >= 0))
+    error = "temperature must not be negative";
+  else if (!(pa.rcut > 0) || !(pa.skin >= 0))
+    error = "rcut has to be positive and skin must not be negative";
+  else if (pa.respa < 1)
+    error = "respa has to be positive";
+  else if (pa.respa > 1 && !(pa.rinner > RESPA_SWITCH && pa.rinner <= pa.rcut))
+    error = "rinner has to be above the switching shell and up to rcut";
+  else if (pa.threads < 0)
+    error = "threads must not be negative";
+  else if (pa.precision != 4 && pa.precision != 8)
+    error = "precision has to be 4 or 8";
+  else if (pa.strides[FIELD_POSITIONS] < 0 ||
+           pa.strides[FIELD_VELOCITIES] < 0 || pa.strides[FIELD_FORCES] < 0)
+    error = "strides must not be negative";
+  else if (pa.output_first < 0)
+    error = "output_first must not be negative";
+  else if (pa.checkpoint_stride < 0)
+    error = "checkpoint_stride must not be negative";
+  else if (pa.sort_stride < 0)
+    error = "sort_stride must not be negative";
+  else if (pa.observe_stride < 0)
+    error = "observe_stride must not be negative";
+  else if (pa.balance_stride < 0)
+    error = "balance_stride must not be negative";
+  else if (pa.counters != 0 && pa.counters != 1)
+    error = "counters has to be 0 or 1";
+  else if (pa.mixed != 0 && pa.mixed != 1)
+    error = "mixed has to be 0 or 1";
+
+  if (error)
+    std::cout << "Error: Wrong parameters: " << error << "." << std::endl;
+  return !error;
+}
+
+/** 
+ * \brief Write the parameters as configuration file.
+ *
+ * The numbers are written with all digits, so reading the file gives exactly
+ * the same parameters, as needed for a restart. Output path and checkpoint
+ * are left out.
+ *
+ * \param[in] pa Reference to the parameters.
+ * \param[in] file Name of the configuration file. */
+void params_write(const Parameters &pa, const std::string &file) {
+  static const char * const shifts[3] = {"none", "energy", "force"};
+
+  std::ofstream out(file.c_str());
+  out.precision(17);
+  out << "sigma = " << pa.sigma << "\n"
+      << "epsilon = " << pa.epsilon << "\n"
+      << "mass = " << pa.mass << "\n"
+      << "particles = " << pa.particles << "\n"
+      << "timesteps = " << pa.timesteps << "\n"
+      << "timestep = " << pa.timestep << "\n"
+      << "temperature = " << pa.temp << "\n"
+      << "rcut = " << pa.rcut << "\n"
+      << "skin = " << pa.skin << "\n"
+      << "respa = " << pa.respa << "\n"
+      << "rinner = " << pa.rinner << "\n"
+      << "shift = " << shifts[pa.shift] << "\n"
+      << "boundary = " << (pa.closed ? "closed" : "periodic") << "\n"
+      << "threads = " << pa.threads << "\n"
+      << "precision = " << pa.precision << "\n"
+      << "position_stride = " << pa.strides[FIELD_POSITIONS] << "\n"
+      << "velocity_stride = " << pa.strides[FIELD_VELOCITIES] << "\n"
+      << "force_stride = " << pa.strides[FIELD_FORCES] << "\n"
+      << "output_first = " << pa.output_first << "\n"
+      << "output_count = " << pa.output_count << "\n"
+      << "checkpoint_stride = " << pa.checkpoint_stride << "\n"
+      << "sort_stride = " << pa.sort_stride << "\n"
+      << "observe_stride = " << pa.observe_stride << "\n"
+      << "balance_stride = " << pa.balance_stride << "\n"
+      << "kernel = " << pa.kernel << "\n"
+      << "counters = " << pa.counters << "\n"
+      << "mixed = " << pa.mixed << "\n";
+  out.close();
+
+  if (!out)
+    std::cout << "Error: Writing the parameters failed." << std::endl;
+}
+
+/** 
+ * \brief Set the parameters from the command line.
+ *
+ * Options are given as --key value or --key=value and are applied from left
+ * to right, so later ones win. --config reads a configuration file at its
+ * place. --benchmark runs the benchmark and --validate the check of the
+ * energy drift instead of a simulation. The
+ * remaining arguments set the number of particles and threads; on a restart
+ * only the number of threads.
+ *
+ * \param[in,out] pa Reference to the parameters.
+ * \param[in] argc Number of arguments.
+ * \param[in] argv Arguments of the program.
+ * \return True if all arguments could be read and the parameters are valid,
+ *         else false. */
+bool params_parse(Parameters &pa, int argc, char **argv) {
+  std::vector<std::string> positional;
+
+  for (int ai = 1; ai < argc; ai++) {
+    std::string arg = argv[ai];
+    if (arg.compare(0, 2, "--") != 0) {
+      positional.push_back(arg);
+      continue;
+    }
+
+    // The benchmark and the check are the only options without value.
+    if (arg == "--benchmark") {
+      pa.benchmark = true;
+      continue;
+    }
+    if (arg == "--validate") {
+      pa.validate = true;
+      continue;
+    }
+
+    std::string key = arg.substr(2), value;
+    size_t eq = key.find('=');
+    if (eq != std::string::npos) {
+      value = key.substr(eq + 1);
+      key.erase(eq);
+    } else if (ai + 1 < argc) {
+      value = argv[++ai];
+    } else {
+      std::cout << "Error: Missing value of " << arg << std::endl;
+      return false;
+    }
+
+    if (key == "config" ? !params_read(pa, value) :
+        !params_set(pa, key, value))
+      return false;
+  }
+
+  static const char * const keys[2] = {"particles", "threads"};
+  size_t first = pa.restart.empty() ? 0 : 1;
+  if (positional.size() > 2 - first) {
+    std::cout << "Error: Too many arguments." << std::endl;
+    return false;
+  }
+  for (size_t k = 0; k < positional.size(); k++)
+    if (!params_set(pa, keys[first + k], positional[k]))
+      return false;
+
+  return params_check(pa);
+}
+
+/** 
+ * \brief Reset the timers and start measuring the simulation.
+ * \param[out] tm Reference to the timers. */
+void timers_start(Timers &tm) {
+  for (int ph = 0; ph < PHASES; ph++)
+    tm.phases[ph] = 0;
+  tm.total = 0;
+  tm.steps = 0;
+  tm.start = std::chrono::steady_clock::now();
+  tm.last = tm.start;
+}
+
+/** 
+ * \brief Add the time since the last reading to a phase.
+ * \param[in,out] tm Reference to the timers.
+ * \param[in] phase Phase that just ended, one of the PHASE_ values; -1 if the
+ *                  time should not be counted to a phase. */
+inline void timers_lap(Timers &tm, int phase) {
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  if (phase >= 0)
+    tm.phases[phase] += std::chrono::duration<double>(now - tm.last).count();
+  tm.last = now;
+}
+
+/** 
+ * \brief Stop measuring the simulation.
+ * \param[in,out] tm Reference to the timers. */
+void timers_stop(Timers &tm) {
+  tm.total = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+    tm.start).count();
+}
+
+// Names of the phases for the reports.
+const char * const phase_names[PHASES] = {"forces", "neighbours",
+  "integration", "boundary", "output", "communication"};
+
+// Names of the hardware events for the reports.
+const char * const counter_names[COUNTERS] = {"cycles", "instructions",
+  "cache_misses", "fp_scalar", "fp_vector"};
+
+/** 
+ * \brief Print the time of all phases as table.
+ *
+ * Everything not in a phase, like the setup of the simulation, is shown as
+ * other time.
+ *
+ * \param[in] tm Reference to the stopped timers. */
+void timers_report(const Timers &tm) {
+  double other = tm.total;
+  for (int ph = 0; ph < PHASES; ph++)
+    other -= tm.phases[ph];
+
+  std::cout << "\n" << std::left << std::setw(16) << "Phase" << std::right
+	    << std::setw(12) << "Time /s" << std::setw(10) << "Share"
+	    << std::setw(16) << "Per step /ms" << std::endl;
+
+  std::streamsize precision = std::cout.precision();
+  std::cout << std::fixed;
+  for (int ph = 0; ph <= PHASES; ph++) {
+    double t = ph < PHASES ? tm.phases[ph] : other;
+    std::cout << std::left << std::setw(16)
+	      << (ph < PHASES ? phase_names[ph] : "other") << std::right
+	      << std::setprecision(4) << std::setw(12) << t
+	      << std::setprecision(1) << std::setw(9)
+	      << (tm.total > 0 ? 100 * t / tm.total : 0) << "%"
+	      << std::setprecision(4) << std::setw(16)
+	      << (tm.steps > 0 ? 1e3 * t / tm.steps : 0) << std::endl;
+  }
+  std::cout << std::left << std::setw(16) << "total" << std::right
+	    << std::setw(12) << tm.total << std::endl;
+  std::cout.unsetf(std::ios::floatfield);
+  std::cout.precision(precision);
+}
+
+/** 
+ * \brief Write the time of all phases as JSON file.
+ * \param[in] tm Reference to the stopped timers.
+ * \param[in] file Name of the JSON file.
+ * \param[in] ps Reference to the particles.
+ * \param[in] kernel Name of the force kernel.
+ * \param[in] threads Number of threads.
+ * \param[in] cn Reference to the closed hardware counters; they are left
+ *               out if they were not counted. */
+void timers_write(const Timers &tm, const std::string &file,
+  const Particles &ps, const char *kernel, int threads, const Counters &cn) {
+  double other = tm.total;
+  for (int ph = 0; ph < PHASES; ph++)
+    other -= tm.phases[ph];
+
+  std::ofstream out(file.c_str());
+  out.precision(9);
+  out << "{\n"
+      << "  \"particles\": " << ps.n << ",\n"
+      << "  \"steps\": " << tm.steps << ",\n"
+      << "  \"threads\": " << threads << ",\n"
+      << "  \"kernel\": \"" << kernel << "\",\n"
+      << "  \"total\": " << tm.total << ",\n"
+      << "  \"phases\": {\n";
+  for (int ph = 0; ph <= PHASES; ph++) {
+    double t = ph < PHASES ? tm.phases[ph] : other;
+    out << "    \"" << (ph < PHASES ? phase_names[ph] : "other")
+	<< "\": {\"time\": " << t << ", \"per_step\": "
+	<< (tm.steps > 0 ? t / tm.steps : 0) << "}"
+	<< (ph < PHASES ? ",\n" : "\n");
+  }
+  out << "  }";
+
+  if (cn.values[COUNTER_CYCLES] >= 0) {
+    out << ",\n  \"counters\": {\n    \"pairs\": " << cn.pairs;
+    for (int e = 0; e < COUNTERS; e++)
+      if (cn.values[e] >= 0)
+        out << ",\n    \"" << counter_names[e] << "\": " << cn.values[e];
+    out << "\n  }";
+  }
+  out << "\n}\n";
+  out.close();
+
+  if (!out)
+    std::cout << "Error: Writing the timers failed." << std::endl;
+}
+
+/** 
+ * \brief Print the hardware counters of the force calculation.
+ *
+ * Besides the plain values the instructions per cycle, the events per pair
+ * and the share of vector instructions of all floating point instructions
+ * show whether the force calculation is bound by the memory or by the
+ * arithmetic.
+ *
+ * \param[in] cn Reference to the closed counters. */
+void counters_report(const Counters &cn) {
+  const long long *v = cn.values;
+  if (v[COUNTER_CYCLES] < 0) {
+    if (cn.id)
+      std::cout << "Error: Hardware counters are not available." << std::endl;
+    return;
+  }
+
+  std::cout << "\nHardware counters of the force calculation:" << std::endl;
+  for (int e = 0; e < COUNTERS; e++) {
+    std::cout << "  " << std::left << std::setw(16) << counter_names[e]
+	      << std::right << std::setw(16);
+    if (v[e] < 0)
+      std::cout << "n/a" << std::endl;
+    else
+      std::cout << v[e] << std::setw(12) << std::setprecision(4)
+		<< (double) v[e] / std::max(cn.pairs, 1LL) << " per pair"
+		<< std::endl;
+  }
+
+  if (v[COUNTER_INSTRUCTIONS] >= 0)
+    std::cout << "  Instructions per cycle: " << (double)
+      v[COUNTER_INSTRUCTIONS] / std::max(v[COUNTER_CYCLES], 1LL) << std::endl;
+  if (v[COUNTER_FP_SCALAR] >= 0 && v[COUNTER_FP_VECTOR] >= 0)
+    std::cout << "  Vector share of floating point instructions: "
+	      << 100.0 * v[COUNTER_FP_VECTOR] / std::max(v[COUNTER_FP_SCALAR] +
+		   v[COUNTER_FP_VECTOR], 1LL) << "%" << std::endl;
+}
+
+/**
+ * \brief Thermodynamic observables of the system at one time step. */
+struct Observables {
+  // Potential, kinetic and total energy /J.
+  double potential, kinetic, total;
+
+  // Temperature /K and pressure /Pa.
+  double temperature, pressure;
+};
+
+/** 
+ * \brief Calculate the observables from the velocities and the sums of the
+ *        force calculation.
+ *
+ * The pressure follows from the virial theorem as P = (2 Ek + W) / (3 V)
+ * with the virial W, the sum of r * F over all pairs.
+ *
+ * \param[out] ob Reference to the observables.
+ * \param[in] ps Reference to the particles.
+ * \param[in] box Reference to the box.
+ * \param[in] sums Potential energy and virial from accel(), first of all
+ *                 pairs or the inner range, then of the outer range.
+ * \param[in] pa Parameters of the simulation.
+ * \param[in] dm Reference to the domain; the observables are summed up over
+ *               all ranks. */
+void observe(Observables &ob, const Particles &ps, const Box &box,
+  const double *sums, const Parameters &pa, const Domain &dm) {
+  double volume = (box.right - box.left) * (box.top - box.bottom) *
+    (box.back - box.front);
+
+  // Sums of the pairs, kinetic energy and number of particles.
+  double all[6] = {sums[0], sums[1], sums[2], sums[3],
+    0.5 * pa.mass * ps.mv.squaredNorm(), (double) ps.n};
+  domain_sum(dm, all, 6);
+
+  ob.potential = all[0] + all[2];
+  ob.kinetic = all[4];
+  ob.total = ob.potential + ob.kinetic;
+  ob.temperature = 2 * ob.kinetic / (3 * all[5] * KB);
+  ob.pressure = (2 * ob.kinetic + all[1] + all[3]) / (3 * volume);
+}
+
+/** 
+ * \brief Append one line of observables to the time series.
+ * \param[in,out] out Stream of the observables file.
+ * \param[in] step Number of the time step.
+ * \param[in] ob Reference to the observables.
+ * \param[in] pa Parameters of the simulation. */
+void observe_write(std::ofstream &out, long step, const Observables &ob,
+  const Parameters &pa) {
+  out << step << " " << step * pa.timestep << " " << ob.potential << " "
+      << ob.kinetic << " " << ob.total << " " << ob.temperature << " "
+      << ob.pressure << "\n";
+}
+
+/** 
+ * \brief Simulate the system by calculation with velocity verlet algorithm.
+ *
+ * A restarted simulation goes on bit by bit as the original one would have
+ * done with the same number of threads and ranks. It continues the output
+ * files found in the output path, see app_run(). With several MPI ranks
+ * every rank moves the particles of its sub-box, and the first one writes
+ * the files for all of them.
+ *
+ * \param[in,out] st Reference to the state of the simulation.
+ * \param[in] restart True if the state comes from a checkpoint, else false.
+ * \param[in] serialize True if serialization wanted, else false. Then a
+ *                      checkpoint and the observables are written as often
+ *                      as the parameters say.
+ * \param[in] pa Parameters of the simulation. */
+void simulate(State &st, bool restart, bool serialize, const Parameters &pa) {
+  // Wall clock time of the phases of the simulation.
+  Timers tm;
+  timers_start(tm);
+
+  // Every rank keeps the particles of its own sub-box.
+  Domain dm;
+  if (!domain_init(dm, st.box, pa, st.cuts))
+    return;
+  domain_distribute(dm, st, restart);
+
+  // The borders of the sub-boxes go into the checkpoints.
+  for (int d = 0; d < 3; d++) {
+    st.cuts[d].clear();
+#ifdef USE_MPI
+    if (dm.size > 1)
+      st.cuts[d] = dm.cuts[d];
+#endif
+  }
+  bool write = serialize && dm.rank == 0;
+
+  // If serialization is wanted. Initialize the system to do so. The
+  // parameters are saved along, so the run can be repeated.
+  std::string path;
+  if (write) {
+    path = init_serialize(pa);
+    params_write(pa, path + "parameters.cfg");
+  }
+
+  Particles &ps = st.ps;
+  NeighbourList &nl = st.nl;
+  const Box &box = st.box;
+
+  // With several ranks the particles of all of them are gathered for the
+  // output.
+  double total = ps.n;
+  domain_sum(dm, &total, 1);
+  State whole;
+  State &out = dm.size > 1 ? whole : st;
+  if (write && dm.size > 1) {
+    particles_init(whole.ps, total);
+    whole.nl.mp0.setZero(whole.ps.mp.rows(), 3);
+  }
+
+  // The frames of every field go into one binary file, written by a
+  // separate thread.
+  // A restart continues the files of the output path.
+  Writer w;
+  bool started = !write ||
+    writer_start(w, path, out.ps, box, pa, restart ? st.step : -1);
+  if (domain_any(dm, !started)) {
+    domain_close(dm);
+    return;
+  }
+
+  // Divide the box into cells for building the neighbour list.
+  CellList cl;
+  domain_cells(dm, cl, box, pa);
+
+  // Force kernel for the CPU and the parameters.
+  const Kernel kernel = kernel_select(pa, box);
+
+  // Hardware counters of the force calculation, if wanted.
+  Counters cn;
+  cn.threads = 0;
+  cn.id = 0;
+  cn.enabled = false;
+  for (int e = 0; e < COUNTERS; e++)
+    cn.values[e] = -1;
+  if (pa.counters)
+    counters_open(cn);
+  Counters *counted = pa.counters ? &cn : 0;
+
+  // Accelerations, energies and virials summed up by the threads of the force
+  // calculation.
+  AccelBuffers buffers;
+
+  // The energies, the temperature and the pressure go into a text file at
+  // every observe_stride-th time step. The first and the last total energy
+  // show the drift over the run.
+  std::ofstream obs;
+  Observables ob{}, ob0{};
+  double sums[4] = {0, 0, 0, 0};
+  long observed = 0;
+  bool observe_on = serialize && pa.observe_stride > 0;
+  if (write && observe_on) {
+    text_open(obs, path + "observables.dat", "# step time/s potential/J "
+      "kinetic/J total/J temperature/K pressure/Pa\n",
+      restart ? st.step + 1 : -1);
+    obs.precision(10);
+  }
+
+  // With several ranks the borders of their sub-boxes move every
+  // balance_stride-th time step by the force time of the ranks since the
+  // last time. How uneven it was goes into a text file.
+  std::ofstream bal;
+  bool balance_on = dm.size > 1 && pa.balance_stride > 0;
+  double ratios[2] = {1, 1}, forces0 = 0;
+  long balanced = 0, first = st.step;
+  if (write && balance_on)
+    text_open(bal, path + "balance.dat", "# step max/mean min/mean of the "
+      "force time of the ranks\n", restart ? st.step : -1);
+
+  // Buffers for sorting the particles, allocated before the time steps.
+  Ordering ord;
+  ord.keys.reserve(ps.n);
+  ord.tmp.setZero(ps.mp.rows(), 3);
+  ord.ids.reserve(ps.n);
+
+  // A multiple time step run moves the particles in inner steps with the
+  // forces of the inner pairs, taken from their own list. The forces of the
+  // outer pairs kick the velocities before and after the inner steps.
+  bool respa = pa.respa > 1;
+  int inner = respa ? pa.respa : 1;
+  int range = respa ? RANGE_INNER : RANGE_ALL;
+  NeighbourList il;
+  const NeighbourList &fl = respa ? il : nl;
+
+  // With several ranks the pairs of the own particles are calculated while
+  // the positions of the ghosts are on their way, the pairs with ghosts
+  // afterwards.
+  bool overlap = dm.size > 1;
+  NeighbourList own, halo;
+
+  // Temporary calculations that will be done here once instead of multiple
+  // times inside the loop.
+  double dt = pa.timestep / inner;
+  double td205 = 0.5 * std::pow(dt, 2);
+  double td05 = 0.5 * dt;
+  double to05 = 0.5 * pa.timestep;
+
+  // First calculation of the accelerations. A restarted simulation goes on
+  // with the saved accelerations and neighbour list.
+  if (restart) {
+    neighbours_restore(nl, cl, ps, pa, dm);
+  } else {
+    domain_borders(dm, ps);
+    neighbours_build(nl, cl, ps, pa);
+  }
+  if (respa)
+    neighbours_inner(il, nl, box, ps, pa);
+  if (overlap)
+    neighbours_split(own, halo, fl, ps);
+
+  // The buffers get the rows of the particles and their ghosts.
+  accel_buffers(buffers, ps.mp.rows());
+
+  if (!restart) {
+    accel(ps, fl, box, pa, kernel, range, buffers, observe_on ? sums : 0, 0,
+      0, counted);
+    domain_reverse(dm, ps, ps.ma);
+    if (respa) {
+      accel(ps, nl, box, pa, kernel, RANGE_OUTER, buffers,
+        observe_on ? sums + 2 : 0, 0, 0, counted);
+      domain_reverse(dm, ps, ps.mo);
+    }
+    if (observe_on) {
+      observe(ob, ps, box, sums, pa, dm);
+      if (write)
+        observe_write(obs, st.step, ob, pa);
+      ob0 = ob;
+      observed++;
+    }
+
+    // The initial state is the first frame of every field.
+    if (dm.size > 1 && serialize)
+      domain_gather(dm, st, whole);
+    if (write)
+      writer_push(w, out.ps, st.step);
+  }
+
+  // Start the simulation process in a loop and informate the user about it.
+  int threads = 1;
+#ifdef _OPENMP
+  threads = omp_get_max_threads();
+#endif
+  std::cout << "\nSimulation running with " << kernel.name
+	    << (kernel.reduced ? " reduced units" : "")
+	    << (kernel.mixed ? " mixed precision" : "")
+	    << " force kernel on " << threads << " threads";
+  if (dm.size > 1)
+    std::cout << " per rank, " << dm.size << " ranks";
+  if (respa)
+    std::cout << " and " << inner << " inner steps per time step";
+  std::cout << "...\n" << std::flush;
+
+  // The whole simulation process runs inside a loop. The calculation is
+  // implemented with the Velocity-Störmer algorithm which is the most
+  // appropriate way of calculating in this term.
+  timers_lap(tm, -1);
+  for (long ts = st.step; ts < pa.timesteps; ts++) {
+#ifdef CHECK_ALLOCATIONS
+    // The time step works on preallocated buffers only. Just a rebuild of the
+    // neighbour list may enlarge its buffers for more pairs.
+    long count = allocations;
+    internal::set_is_malloc_allowed(false);
+#endif
+
+    // The sub-boxes change at the first rebuild of the time step.
+    bool balancing = balance_on && ts > first &&
+      ts % pa.balance_stride == 0;
+    if (balancing) {
+      domain_balance(dm, tm.phases[PHASE_FORCES] - forces0, ratios);
+      forces0 = tm.phases[PHASE_FORCES];
+      if (write)
+        bal << ts << " " << ratios[0] << " " << ratios[1] << "\n";
+      balanced++;
+      timers_lap(tm, PHASE_COMMUNICATION);
+    }
+
+    if (respa) {
+      ps.mv += ps.mo*to05;
+      timers_lap(tm, PHASE_INTEGRATION);
+    }
+
+    // The energy and the virial are only summed up at time steps with an
+    // entry in the observables file.
+    bool observing = observe_on && (ts + 1) % pa.observe_stride == 0;
+    bool rebuilt = false;
+
+    for (int is = 0; is < inner; is++) {
+      ps.mp += ps.mv*dt + ps.ma*td205;
+      ps.mv += ps.ma*td05;
+      timers_lap(tm, PHASE_INTEGRATION);
+
+      // All ranks build their lists together.
+      bool outdated = neighbours_outdated(nl, box, ps, pa);
+      timers_lap(tm, PHASE_NEIGHBOURS);
+      outdated = domain_any(dm, outdated) || balancing;
+      timers_lap(tm, PHASE_COMMUNICATION);
+
+      // The particles are sorted only together with a rebuild of the
+      // neighbour list, which has to follow their new rows. The particles
+      // that left the sub-box of their rank move to the new owner before,
+      // and the ghosts are chosen for the new rows.
+      if (outdated) {
+#ifdef CHECK_ALLOCATIONS
+        // A rebuild may enlarge the matrices for more particles and ghosts.
+        internal::set_is_malloc_allowed(true);
+#endif
+        domain_migrate(dm, ps);
+        timers_lap(tm, PHASE_COMMUNICATION);
+        if (balancing) {
+          domain_cells(dm, cl, box, pa);
+#ifdef USE_MPI
+          for (int d = 0; d < 3; d++)
+            st.cuts[d] = dm.cuts[d];
+#endif
+          balancing = false;
+        }
+        if (pa.sort_stride > 0 && ts - st.sorted >= pa.sort_stride) {
+          particles_sort(ps, box, ord);
+          st.sorted = ts;
+        }
+        timers_lap(tm, PHASE_NEIGHBOURS);
+        domain_borders(dm, ps);
+        timers_lap(tm, PHASE_COMMUNICATION);
+        neighbours_build(nl, cl, ps, pa);
+        if (respa)
+          neighbours_inner(il, nl, box, ps, pa);
+        if (overlap)
+          neighbours_split(own, halo, fl, ps);
+        rebuilt = true;
+        timers_lap(tm, PHASE_NEIGHBOURS);
+      } else {
+        domain_post(dm, ps);
+        timers_lap(tm, PHASE_COMMUNICATION);
+      }
+
+      double waited = dm.waited;
+      counters_enable(cn, true);
+      accel(ps, overlap ? own : fl, box, pa, kernel, range, buffers,
+        observing && is == inner - 1 ? sums : 0, overlap ? &halo : 0, &dm,
+        counted);
+      counters_enable(cn, false);
+      cn.pairs += fl.start[ps.n];
+      timers_lap(tm, PHASE_FORCES);
+
+      // Waiting for the ghosts inside the force calculation is communication
+      // that could not be hidden behind the pairs of the own particles.
+      tm.phases[PHASE_FORCES] -= dm.waited - waited;
+      tm.phases[PHASE_COMMUNICATION] += dm.waited - waited;
+      domain_reverse(dm, ps, ps.ma);
+      timers_lap(tm, PHASE_COMMUNICATION);
+      ps.mv += ps.ma*td05;
+      timers_lap(tm, PHASE_INTEGRATION);
+
+      // Correct the velocities and/or positions related to the way of
+      // handling boundary conditions. They can be handled with periodic
+      // boundary or a closed volume like a box.
+      boundary(ps, box);
+      timers_lap(tm, PHASE_BOUNDARY);
+    }
+
+    if (respa) {
+      counters_enable(cn, true);
+      accel(ps, nl, box, pa, kernel, RANGE_OUTER, buffers,
+        observing ? sums + 2 : 0, 0, 0, counted);
+      counters_enable(cn, false);
+      cn.pairs += nl.start[ps.n];
+      timers_lap(tm, PHASE_FORCES);
+      domain_reverse(dm, ps, ps.mo);
+      timers_lap(tm, PHASE_COMMUNICATION);
+      ps.mv += ps.mo*to05;
+      timers_lap(tm, PHASE_INTEGRATION);
+    }
+
+#ifdef CHECK_ALLOCATIONS
+    internal::set_is_malloc_allowed(true);
+    if (allocations != count)
+      (rebuilt ? rebuilding : allocating)++;
+#else
+    (void) rebuilt;
+#endif
+
+    st.step = ts + 1;
+
+    // Write current state to file if wanted.
+    bool checkpoint = serialize && pa.checkpoint_stride > 0 &&
+      st.step % pa.checkpoint_stride == 0;
+    if (dm.size > 1 && serialize &&
+        (checkpoint || writer_fields(pa.strides, st.step) != 0)) {
+      domain_gather(dm, st, whole);
+      timers_lap(tm, PHASE_COMMUNICATION);
+    }
+    if (write) {
+      writer_push(w, out.ps, st.step);
+      if (checkpoint)
+        checkpoint_write(out, path + "checkpoint.bin", pa);
+    }
+    if (observing) {
+      observe(ob, ps, box, sums, pa, dm);
+      if (write)
+        observe_write(obs, st.step, ob, pa);
+      if (!observed++)
+        ob0 = ob;
+    }
+
+    // Print progress.
+    std::cout << (int) 100.0 * ts / pa.timesteps << "%\r" << std::flush;
+    timers_lap(tm, PHASE_OUTPUT);
+    tm.steps++;
+  }
+
+  if (write)
+    writer_stop(w);
+  timers_lap(tm, PHASE_OUTPUT);
+  timers_stop(tm);
+  counters_close(cn);
+
+  // The simulation has been finished! Informate the user about it.
+  std::cout << "finish!\n\n" << std::flush;
+
+  // Show how well the neighbour list could be reused.
+  double lists[2] = {(double) nl.length, (double) ps.n};
+  domain_sum(dm, lists, 2);
+  std::cout << "Neighbour list builds: " << nl.builds
+	    << ", mean list length: " << lists[0] / nl.builds / lists[1]
+	    << std::endl;
+
+  // Show how evenly the force time was spread over the ranks.
+  if (dm.size > 1) {
+    domain_imbalance(dm, tm.phases[PHASE_FORCES], ratios);
+    std::cout << "Force time of the ranks: " << ratios[0] << " max/mean, "
+	      << ratios[1] << " min/mean";
+    if (balanced)
+      std::cout << " after " << balanced << " balancings";
+    std::cout << std::endl;
+  }
+
+#ifdef CHECK_ALLOCATIONS
+  std::cout << "Time steps with heap allocations: " << allocating
+	    << ", and with a rebuild of the neighbour list: " << rebuilding
+	    << std::endl;
+#endif
+
+  // Show how often the simulation had to wait for the disk.
+  if (write)
+    std::cout << "Writer stalls: " << w.stalls << std::endl;
+
+  // Show the last observables and how well the total energy is conserved.
+  if (write && balance_on) {
+    bal.close();
+    if (!bal)
+      std::cout << "Error: Could not write the balance file." << std::endl;
+  }
+
+  if (observed) {
+    if (write)
+      obs.close();
+    std::cout << "Temperature: " << ob.temperature << " K, pressure: "
+	      << ob.pressure << " Pa" << std::endl
+	      << "Total energy drift: " << 100 * (ob.total - ob0.total) /
+		 std::abs(ob0.total) << "% over " << observed << " entries"
+	      << std::endl;
+    if (write && !obs)
+      std::cout << "Error: Could not write the observables file." << std::endl;
+  }
+
+  // Show where the time went, also for scripts.
+  timers_report(tm);
+  counters_report(cn);
+  if (write)
+    timers_write(tm, path + "timers.json", out.ps, kernel.name, threads, cn);
+  domain_close(dm);
+}
+
+/** 
+ * \brief Put particles on a simple cubic lattice in a periodic box.
+ * \param[out] ps Reference to the particles.
+ * \param[out] box Reference to the box around the lattice.
+ * \param[in] side Number of particles per side of the lattice.
+ * \param[in] density Number of particles per cubed sigma.
+ * \param[in] pa Parameters of the simulation.
+ * \param[in,out] generator Random number generator for the velocities. */
+void bench_lattice(Particles &ps, Box &box, int side, double density,
+  const Parameters &pa, std::default_random_engine &generator) {
+  double a = pa.sigma / std::cbrt(density), l = side * a;
+
+  particles_init(ps, side * side * side);
+  for (int pi = 0; pi < ps.n; pi++) {
+    ps.mp(pi, 0) = (pi % side + 0.5) * a;
+    ps.mp(pi, 1) = (pi / side % side + 0.5) * a;
+    ps.mp(pi, 2) = (pi / side / side + 0.5) * a;
+  }
+  init_velocities(ps, generator, pa);
+
+  Box b = {0, l, l, 0, 0, l, false};
+  box = b;
+}
+
+/** 
+ * \brief Measure one case of the benchmark and print the result.
+ *
+ * Like Google Benchmark the case runs in batches of doubling size until
+ * BENCHMARK_TIME has passed, after one run for warming up. The wall time is
+ * measured, so the threads are not summed up.
+ *
+ * \param[in] name Name of the case.
+ * \param[in] items Number of items handled by one run of the case.
+ * \param[in] unit Name of the items.
+ * \param[in] run Function running the case once. */
+template <typename F>
+void bench_run(const std::string &name, double items, const char *unit,
+  F run) {
+  typedef std::chrono::steady_clock clock;
+
+  run();
+
+  long iterations = 0;
+  double elapsed = 0;
+  clock::time_point start = clock::now();
+  for (long batch = 1; elapsed < BENCHMARK_TIME; batch *= 2) {
+    for (long i = 0; i < batch; i++)
+      run();
+    iterations += batch;
+    elapsed = std::chrono::duration<double>(clock::now() - start).count();
+  }
+
+  double t = elapsed / iterations;
+  std::cout << std::left << std::setw(40) << name << std::right
+	    << std::setw(12) << iterations << std::setw(14) << std::setprecision(4)
+	    << t * 1e9 << " ns" << std::setw(12) << t * 1e9 / items << " ns/"
+	    << unit << std::setw(12) << items / t << " " << unit << "s/s"
+	    << std::endl;
+}
+
+/** 
+ * \brief Simulate a small periodic lattice without output and measure the
+ *        drift of its total energy.
+ *
+ * The drift is the slope of a straight line fitted to the total energy
+ * sampled every DRIFT_SAMPLE time steps, so the fluctuations of the energy
+ * do not count as drift.
+ *
+ * \param[in] pa Parameters of the simulation.
+ * \param[in] kernel Force kernel to simulate with.
+ * \param[in] steps Number of time steps.
+ * \return Drift of the total energy relative to its start per unit of
+ *         sigma * sqrt(mass / epsilon). */
+double bench_drift(const Parameters &pa, const Kernel &kernel, long steps) {
+  std::default_random_engine generator;
+  AccelBuffers buffers;
+  Particles ps;
+  Box box;
+  NeighbourList nl;
+  CellList cl;
+
+  bench_lattice(ps, box, 10, 0.8, pa, generator);
+  cells_init(cl, box, (pa.rcut + pa.skin) * pa.sigma);
+  nl.builds = 0;
+  nl.length = 0;
+  neighbours_build(nl, cl, ps, pa);
+  accel_buffers(buffers, ps.mp.rows());
+
+  // The benchmark runs in a single process.
+  Domain dm;
+  dm.rank = 0;
+  dm.size = 1;
+
+  double sums[4] = {0, 0, 0, 0};
+  Observables ob0, ob;
+  accel(ps, nl, box, pa, kernel, RANGE_ALL, buffers, sums);
+  observe(ob0, ps, box, sums, pa, dm);
+
+  // Sums of the least squares fit of the relative energy over the time.
+  double unit = pa.sigma * std::sqrt(pa.mass / pa.epsilon);
+  double n = 1, st = 0, se = 0, stt = 0, ste = 0;
+
+  double td205 = 0.5 * std::pow(pa.timestep, 2);
+  double td05 = 0.5 * pa.timestep;
+  for (long ts = 0; ts < steps; ts++) {
+    bool sample = (ts + 1) % DRIFT_SAMPLE == 0;
+    ps.mp += ps.mv*pa.timestep + ps.ma*td205;
+    ps.mv += ps.ma*td05;
+    neighbours_update(nl, cl, ps, pa);
+    accel(ps, nl, box, pa, kernel, RANGE_ALL, buffers, sample ? sums : 0);
+    ps.mv += ps.ma*td05;
+    boundary(ps, box);
+
+    if (sample) {
+      observe(ob, ps, box, sums, pa, dm);
+      double t = (ts + 1) * pa.timestep / unit;
+      double e = (ob.total - ob0.total) / std::abs(ob0.total);
+      n++;
+      st += t;
+      se += e;
+      stt += t*t;
+      ste += t*e;
+    }
+  }
+
+  return (n*ste - st*se) / (n*stt - st*st);
+}
+
+/** 
+ * \brief Run the benchmark of the force kernels, the integrator, the
+ *        boundary conditions and the writer.
+ *
+ * The force kernels are measured for all kernels supported by the CPU, in
+ * double and mixed precision, at several numbers of particles and densities
+ * of a periodic lattice; the other parts at the largest number of
+ * particles. All cases use the parameters and threads of the command line.
+ *
+ * \param[in] pa Parameters of the simulation.
+ * \return Exit code of the program. */
+int benchmark(const Parameters &pa) {
+  static const int sides[3] = {10, 20, 32};
+  static const double densities[3] = {0.5, 0.8, 1.0};
+
+  int threads = 1;
+#ifdef _OPENMP
+  threads = omp_get_max_threads();
+#endif
+  std::cout << "\nBenchmark on " << threads << " threads\n\n"
+	    << std::left << std::setw(40) << "Case" << std::right
+	    << std::setw(12) << "Iterations" << std::setw(17) << "Time"
+	    << std::setw(18) << "Time per item" << std::setw(20) << "Throughput"
+	    << std::endl;
+
+  std::default_random_engine generator;
+  AccelBuffers buffers;
+  State st;
+  Particles &ps = st.ps;
+  NeighbourList &nl = st.nl;
+  CellList cl;
+
+  for (int si = 0; si < 3; si++)
+  for (int di = 0; di < 3; di++) {
+    bench_lattice(ps, st.box, sides[si], densities[di], pa, generator);
+    cells_init(cl, st.box, (pa.rcut + pa.skin) * pa.sigma);
+    nl.builds = 0;
+    nl.length = 0;
+    neighbours_build(nl, cl, ps, pa);
+    accel_buffers(buffers, ps.mp.rows());
+
+    std::ostringstream cs;
+    cs << "/n=" << ps.n << "/rho=" << densities[di];
+
+    bench_run("neighbours" + cs.str(), ps.n, "particle",
+      [&] { neighbours_build(nl, cl, ps, pa); });
+
+    for (int ki = 0; ki < KERNELS; ki++)
+    for (int mi = 0; mi < 2; mi++) {
+      Parameters kp = pa;
+      kp.mixed = mi;
+      Kernel kernel = kernel_find(kernel_names[ki], kp, st.box);
+      if (!kernel.accel[RANGE_ALL])
+        continue;
+      bench_run(std::string("accel/") + kernel.name + (mi ? "-mixed" : "") +
+        cs.str(), nl.start[ps.n], "pair",
+        [&] { accel(ps, nl, st.box, pa, kernel, RANGE_ALL, buffers, 0); });
+    }
+  }
+
+  // The other parts start from a new lattice of the largest size, which is
+  // moved by whole time steps first. The integrator alone does not keep the
+  // particles apart, so it follows afterwards.
+  bench_lattice(ps, st.box, sides[2], densities[1], pa, generator);
+  cells_init(cl, st.box, (pa.rcut + pa.skin) * pa.sigma);
+  neighbours_build(nl, cl, ps, pa);
+  const Kernel kernel = kernel_select(pa, st.box);
+  accel(ps, nl, st.box, pa, kernel, RANGE_ALL, buffers, 0);
+
+  double td205 = 0.5 * std::pow(pa.timestep, 2);
+  double td05 = 0.5 * pa.timestep;
+  std::ostringstream cs;
+  cs << "/n=" << ps.n << "/rho=" << densities[1];
+
+  bench_run("step/" + std::string(kernel.name) + cs.str(), 1, "step", [&] {
+    ps.mp += ps.mv*pa.timestep + ps.ma*td205;
+    ps.mv += ps.ma*td05;
+    neighbours_update(nl, cl, ps, pa);
+    accel(ps, nl, st.box, pa, kernel, RANGE_ALL, buffers, 0);
+    ps.mv += ps.ma*td05;
+    boundary(ps, st.box);
+  });
+  bench_run("integrate" + cs.str(), ps.n, "particle", [&] {
+    ps.mp += ps.mv*pa.timestep + ps.ma*td205;
+    ps.mv += ps.ma*td05;
+    ps.mv += ps.ma*td05;
+  });
+  bench_run("boundary" + cs.str(), ps.n, "particle",
+    [&] { boundary(ps, st.box); });
+
+  // Every push hands over a frame of the positions. The files are removed
+  // afterwards.
+  Parameters wp = pa;
+  wp.strides[FIELD_POSITIONS] = 1;
+  wp.strides[FIELD_VELOCITIES] = 0;
+  wp.strides[FIELD_FORCES] = 0;
+  wp.output_first = 0;
+  wp.output_count = -1;
+  std::string path = init_serialize(wp);
+  Writer w;
+  writer_start(w, path, ps, st.box, wp, -1);
+  long step = 0;
+  bench_run("writer" + cs.str(), 1, "frame",
+    [&] { writer_push(w, ps, step++); });
+  writer_stop(w);
+  std::remove((path + "positions.bin").c_str());
+  std::remove(path.c_str());
+
+  return 0;
+}
+
+/** 
+ * \brief Check that the mixed precision kernels conserve the energy about as
+ *        well as the double precision ones.
+ *
+ * Every kernel supported by the CPU simulates the same periodic lattice at
+ * the time step DRIFT_TIMESTEP, whatever the timestep of the command line.
+ * The drift of a mixed precision kernel may be at most DRIFT_FACTOR times
+ * the one of its double precision kernel, plus DRIFT_FLOOR.
+ *
+ * \param[in] pa Parameters of the simulation.
+ * \return Exit code of the program; 1 if a mixed precision kernel does not
+ *         conserve the energy. */
+int validate(const Parameters &pa) {
+  Parameters vp = pa;
+  vp.timestep = DRIFT_TIMESTEP * pa.sigma * std::sqrt(pa.mass / pa.epsilon);
+  Box box;
+  std::default_random_engine generator;
+  Particles ps;
+  bench_lattice(ps, box, 10, 0.8, vp, generator);
+
+  std::cout << "\nRelative drift of the total energy per unit of time over "
+	    << DRIFT_STEPS << " time steps of " << DRIFT_TIMESTEP << std::endl;
+  bool ok = true;
+  for (int ki = 0; ki < KERNELS; ki++) {
+    Parameters kp = vp;
+    kp.mixed = 0;
+    Kernel kernel = kernel_find(kernel_names[ki], kp, box);
+    if (!kernel.accel[RANGE_ALL])
+      continue;
+    double drift = bench_drift(kp, kernel, DRIFT_STEPS);
+    std::cout << std::left << std::setw(40) << std::string("drift/") +
+		 kernel.name << std::right << std::setw(12) << drift
+	      << std::endl;
+
+    kp.mixed = 1;
+    kernel = kernel_find(kernel_names[ki], kp, box);
+    if (!kernel.accel[RANGE_ALL])
+      continue;
+    double mixed = bench_drift(kp, kernel, DRIFT_STEPS);
+    std::cout << std::left << std::setw(40) << std::string("drift/") +
+		 kernel.name + "-mixed" << std::right << std::setw(12) << mixed
+	      << std::endl;
+    if (std::abs(mixed) > DRIFT_FACTOR * std::abs(drift) + DRIFT_FLOOR) {
+      std::cout << "Error: Mixed precision drifts off the double precision."
+		<< std::endl;
+      ok = false;
+    }
+  }
+
+  return ok ? 0 : 1;
+}
+
+/** 
+ * \brief Write short information about the application. */
+void app_info() {
   std::cout << "Molecular Dynamic Simulation (Ver. " << __version__ << ")"
 	    << std::endl << "by " << __author__ << " <" << __email__ << ">"
 	    << std::endl;
 }
 
 /** 
- * \brief Main entry point of the application. */
-int main(int argc, char **argv) {
+ * \brief Write the command line usage of the application.
+ * \param[in] name Name of the program. */
+void app_usage(const char *name) {
+  std::cout << "Usage: " << name << " [options] [particles] [threads]"
+	    << std::endl
+	    << "       " << name << " [options] --restart <checkpoint> [threads]"
+	    << std::endl << std::endl
+	    << "Options:" << std::endl
+	    << "  --config <file>  read parameters from lines key = value"
+	    << std::endl
+	    << "  --<key> <value>  set one parameter, also as --<key>=<value>"
+	    << std::endl
+	    << "  --benchmark      measure the parts of the simulation" << std::endl
+	    << "  --validate       check the energy drift of the force kernels"
+	    << std::endl
+	    << std::endl
+	    << "Parameters: sigma, epsilon, mass, particles, timesteps, "
+	       "timestep," << std::endl
+	    << "  temperature, rcut, skin, shift (none, energy, force), "
+	       "boundary" << std::endl
+	    << "  (closed, periodic), threads, precision (4, 8), "
+	       "position_stride," << std::endl
+	    << "  velocity_stride, force_stride, output_first, output_count,"
+	    << std::endl
+	    << "  checkpoint_stride, output, restart, kernel (auto, avx512, avx2,"
+	    << std::endl << "  generic), counters (0, 1), sort_stride, "
+	       "observe_stride, respa," << std::endl << "  rinner, mixed (0, 1), "
+	       "balance_stride"
+	    << std::endl
+	    << std::endl
+	    << "With respa > 1 the timestep is the outer one; the pairs closer "
+	       "than" << std::endl << "  rinner are integrated with respa "
+	       "inner steps per timestep." << std::endl
+	    << "A restart continues the files of the output path behind the "
+	       "step of the" << std::endl << "  checkpoint." << std::endl;
+#ifdef USE_MPI
+  std::cout << "Start it with mpirun -np <ranks> to split the box over the "
+	       "ranks." << std::endl;
+#endif
+}
+
+/** 
+ * \brief Run the application as given by the command line.
+ *
+ * All parameters start with their defaults and can be changed by
+ * configuration files and options, see params_parse(). A simulation can be
+ * continued from a checkpoint with --restart; its parameters have to match
+ * the saved ones, as given by the parameters.cfg of the output path.
+ *
+ * A restart into the same output path continues its files. The frames of
+ * the trajectories and the entries of the observables and the balancing
+ * behind the step of the checkpoint are dropped, as they are written again,
+ * and the new ones are appended. A trajectory with another field, stride,
+ * selection or precision stops the restart. In a new output path the files
+ * start with the step of the checkpoint.
+ *
+ * \param[in] argc Number of arguments.
+ * \param[in] argv Arguments of the command line.
+ * \return Exit code of the program. */
+int app_run(int argc, char **argv) {
+    // With several MPI ranks only the first one talks to the user.
+    int rank = 0;
+#ifdef USE_MPI
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+#endif
+    if (rank != 0)
+      std::cout.setstate(std::ios::failbit);
+
     // Print application starting information.
     app_info();
 
-    // Matrices for position, velocity and acceleration.
-    Matrix3Td mp, mv, ma;
+    // Parameters of the simulation.
+    Parameters pa;
+    params_default(pa);
+    if (!params_parse(pa, argc, argv)) {
+      app_usage(argv[0]);
+      return 1;
+    }
+
+    // Number of threads for the force calculation, else OpenMP decides about
+    // it.
+#ifdef _OPENMP
+    if (pa.threads > 0)
+      omp_set_num_threads(pa.threads);
+#endif
+
+    // The benchmark and the check measure a single process.
+    if (pa.benchmark)
+      return rank == 0 ? benchmark(pa) : 0;
+    if (pa.validate)
+      return rank == 0 ? validate(pa) : 0;
+
+    // Matrices for position, velocity and acceleration and the rest of the
+    // simulation state.
+    State st;
+    bool restart = !pa.restart.empty();
+    if (restart) {
+      if (!checkpoint_read(st, pa.restart, pa))
+        return 1;
+    } else {
+      particles_init(st.ps, pa.particles);
+
+      // Initialization of the position and velocity matrices.
+      init_grid(st.ps);
+      init_velocities(st.ps, st.generator, pa);
 
-    // Initialization of the position and velocity matrices.
-    init_grid(mp);
-    init_velocities(mv);
+      // Calculate box borders from number of particles.
+      double po = cbrt(pa.particles);
+      Box box = {0, po, po, 0, 0, po, pa.closed};
+      st.box = box;
 
-    // Start timer.
-    std::clock_t stime = std::clock();
+      st.step = 0;
+      st.sorted = 0;
+      st.nl.builds = 0;
+      st.nl.length = 0;
+    }
+
+    // Start timer. The wall time is measured, as the threads would be summed
+    // up in the processor time.
+    std::chrono::steady_clock::time_point stime =
+      std::chrono::steady_clock::now();
     
     // Start the main simulation process.
-    simulate(mp, mv, ma, true);
+    simulate(st, restart, true, pa);
 
     // End timer and show result.
     std::cout << "Time needed for simulation: "
-	      << (std::clock() - stime) / (double) CLOCKS_PER_SEC
-	      << "s" << std::endl;
+	      << std::chrono::duration<double>(std::chrono::steady_clock::now() -
+		   stime).count() << "s" << std::endl;
+
+    // The allocation check fails if a time step allocated.
+#ifdef CHECK_ALLOCATIONS
+    if (allocating)
+      return 1;
+#endif
 
     // Exit application.
     return 0;
 }
+
+/** 
+ * \brief Main entry point of the application.
+ *
+ * With MPI every rank runs the application; only the main thread of a rank
+ * calls MPI. */
+int main(int argc, char **argv) {
+#ifdef USE_MPI
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    int code = app_run(argc, argv);
+    MPI_Finalize();
+    return code;
+#else
+    return app_run(argc, argv);
+#endif
+}